@@ -9,6 +9,7 @@
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include "../common/line_buffer.hpp"
 using namespace boost::asio;
 io_service service;
 
@@ -20,7 +21,7 @@ class talk_to_svr : public boost::enable_shared_from_this<talk_to_svr>
                   , boost::noncopyable {
     typedef talk_to_svr self_type;
     talk_to_svr(const std::string & message) 
-      : sock_(service), started_(true), message_(message) {}
+      : sock_(service), read_buffer_(max_msg), started_(true), message_(message) {}
     void start(ip::tcp::endpoint ep) {
         sock_.async_connect(ep, MEM_FN1(on_connect,_1));
     }
@@ -46,7 +47,12 @@ private:
     }
     void on_read(const error_code & err, size_t bytes) {
         if ( !err) {
-            std::string copy(read_buffer_, bytes - 1);
+            read_buffer_.commit(bytes);
+            std::string copy;
+            if ( !read_buffer_.next_line(copy) && !read_buffer_.overflow()) {
+                do_read(); // message is not full yet
+                return;
+            }
             std::cout << "server echoed our " << message_ << ": "
                       << (copy == message_ ? "OK" : "FAIL") << std::endl;
         }
@@ -57,8 +63,7 @@ private:
         do_read();
     }
     void do_read() {
-        async_read(sock_, buffer(read_buffer_), 
-                   MEM_FN2(read_complete,_1,_2), MEM_FN2(on_read,_1,_2));
+        sock_.async_read_some(read_buffer_.prepare(), MEM_FN2(on_read,_1,_2));
     }
     void do_write(const std::string & msg) {
         if ( !started() ) return;
@@ -66,17 +71,11 @@ private:
         sock_.async_write_some( buffer(write_buffer_, msg.size()), 
                                 MEM_FN2(on_write,_1,_2));
     }
-    size_t read_complete(const boost::system::error_code & err, size_t bytes) {
-        if ( err) return 0;
-        bool found = std::find(read_buffer_, read_buffer_ + bytes, '\n') < read_buffer_ + bytes;
-        // we read one-by-one until we get to enter, no buffering
-        return found ? 0 : 1;
-    }
 
 private:
     ip::tcp::socket sock_;
     enum { max_msg = 1024 };
-    char read_buffer_[max_msg];
+    line_buffer read_buffer_;
     char write_buffer_[max_msg];
     bool started_;
     std::string message_;
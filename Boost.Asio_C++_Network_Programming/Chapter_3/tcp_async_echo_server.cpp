@@ -9,6 +9,7 @@
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include "../common/line_buffer.hpp"
 using namespace boost::asio;
 using namespace boost::posix_time;
 io_service service;
@@ -20,7 +21,7 @@ io_service service;
 
 class talk_to_client : public boost::enable_shared_from_this<talk_to_client>, boost::noncopyable {
     typedef talk_to_client self_type;
-    talk_to_client() : sock_(service), started_(false) {}
+    talk_to_client() : sock_(service), read_buffer_(max_msg), started_(false) {}
 public:
     typedef boost::system::error_code error_code;
     typedef boost::shared_ptr<talk_to_client> ptr;
@@ -42,9 +43,15 @@ public:
 private:
     void on_read(const error_code & err, size_t bytes) {
         if ( !err) {
-            std::string msg(read_buffer_, bytes);
-            // echo message back, and then stop
-            do_write(msg + "\n");
+            read_buffer_.commit(bytes);
+            std::string msg;
+            if ( read_buffer_.next_line(msg))
+                // echo message back, and then stop
+                do_write(msg + "\n");
+            else if ( !read_buffer_.overflow()) {
+                do_read(); // message is not full yet
+                return;
+            }
         }
         stop();
     }
@@ -53,24 +60,17 @@ private:
         do_read();
     }
     void do_read() {
-        async_read(sock_, buffer(read_buffer_), 
-                   MEM_FN2(read_complete,_1,_2), MEM_FN2(on_read,_1,_2));
+        sock_.async_read_some(read_buffer_.prepare(), MEM_FN2(on_read,_1,_2));
     }
     void do_write(const std::string & msg) {
         std::copy(msg.begin(), msg.end(), write_buffer_);
         sock_.async_write_some( buffer(write_buffer_, msg.size()), 
                                 MEM_FN2(on_write,_1,_2));
     }
-    size_t read_complete(const boost::system::error_code & err, size_t bytes) {
-        if ( err) return 0;
-        bool found = std::find(read_buffer_, read_buffer_ + bytes, '\n') < read_buffer_ + bytes;
-        // we read one-by-one until we get to enter, no buffering
-        return found ? 0 : 1;
-    }
 private:
     ip::tcp::socket sock_;
     enum { max_msg = 1024 };
-    char read_buffer_[max_msg];
+    line_buffer read_buffer_;
     char write_buffer_[max_msg];
     bool started_;
 };
@@ -9,26 +9,21 @@
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include "../common/line_buffer.hpp"
 using namespace boost::asio;
 using boost::system::error_code;
 io_service service;
 
-size_t read_complete(char * buf, const error_code & err, size_t bytes) {
-    if ( err) return 0;
-    bool found = std::find(buf, buf + bytes, '\n') < buf + bytes;
-    // we read one-by-one until we get to enter, no buffering
-    return found ? 0 : 1;
-}
-
 ip::tcp::endpoint ep( ip::address::from_string("127.0.0.1"), 8001);
 void sync_echo(std::string msg) {
     msg += "\n";
     ip::tcp::socket sock(service);
     sock.connect(ep);
     sock.write_some(buffer(msg));
-    char buf[1024];
-    int bytes = read(sock, buffer(buf), boost::bind(read_complete,buf,_1,_2));
-    std::string copy(buf, bytes - 1);
+    line_buffer buf;
+    std::string copy;
+    while ( !buf.next_line(copy) && !buf.overflow())
+        buf.commit( sock.read_some(buf.prepare()));
     msg = msg.substr(0, msg.size() - 1);
     std::cout << "server echoed our " << msg << ": "
                 << (copy == msg ? "OK" : "FAIL") << std::endl;
@@ -9,28 +9,24 @@
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include "../common/line_buffer.hpp"
 using namespace boost::asio;
 using namespace boost::posix_time;
 using boost::system::error_code;
 
 io_service service;
-size_t read_complete(char * buff, const error_code & err, size_t bytes) {
-    if ( err) return 0;
-    bool found = std::find(buff, buff + bytes, '\n') < buff + bytes;
-    // we read one-by-one until we get to enter, no buffering
-    return found ? 0 : 1;
-}
 
 void handle_connections() {
     ip::tcp::acceptor acceptor(service, ip::tcp::endpoint(ip::tcp::v4(),8001));
-    char buff[1024];
+    line_buffer buff;
     while ( true) {
         ip::tcp::socket sock(service);
         acceptor.accept(sock);
-        int bytes = read(sock, buffer(buff), 
-                    boost::bind(read_complete,buff,_1,_2));
-        std::string msg(buff, bytes);
-        sock.write_some(buffer(msg));
+        buff.clear();
+        std::string msg;
+        while ( !buff.next_line(msg) && !buff.overflow())
+            buff.commit( sock.read_some(buff.prepare()));
+        sock.write_some(buffer(msg + "\n"));
         sock.close();
     }
 }
@@ -3,8 +3,17 @@
 #include <stdio.h>
 #endif
 
+#include <cstdlib>
+#include <cstring>
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
 
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
@@ -26,7 +35,93 @@ void sync_echo(std::string msg) {
     sock.close();
 }
 
+#ifdef __linux__
+/** blaster (Linux): measures the batch mode of the server
+    - each thread sends batches of datagrams with one sendmmsg(), and
+      reads the echoes with recvmmsg()
+    - at most "window" datagrams are in flight per thread, so we measure
+      what the server echoes, not how fast we can fill its queue
+*/
+boost::atomic<size_t> blast_sent(0), blast_received(0);
+boost::atomic<bool> blasting(true);
+void blast(size_t msg_size) {
+    enum { max_batch = 64, window = 512, max_msg = 2048 };
+    if ( msg_size > max_msg) msg_size = max_msg;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(8001);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    connect(fd, (sockaddr*)&addr, sizeof(addr));
+    timeval timeout = { 0, 100 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char out[max_msg], in[max_batch][max_msg];
+    std::memset(out, 'x', sizeof(out));
+    iovec out_iov = { out, msg_size }, in_iovs[max_batch];
+    mmsghdr out_msgs[max_batch], in_msgs[max_batch];
+    std::memset(out_msgs, 0, sizeof(out_msgs));
+    for ( int i = 0; i < max_batch; ++i) {
+        out_msgs[i].msg_hdr.msg_iov = &out_iov;
+        out_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    size_t in_flight = 0;
+    while ( blasting) {
+        if ( in_flight + max_batch <= window) {
+            int n = sendmmsg(fd, out_msgs, max_batch, 0);
+            if ( n > 0) {
+                in_flight += n;
+                blast_sent += n;
+            }
+        }
+        std::memset(in_msgs, 0, sizeof(in_msgs));
+        for ( int i = 0; i < max_batch; ++i) {
+            in_iovs[i].iov_base = in[i];
+            in_iovs[i].iov_len = max_msg;
+            in_msgs[i].msg_hdr.msg_iov = &in_iovs[i];
+            in_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        // while the window is full, wait for echoes (up to the timeout)
+        int flags = in_flight + max_batch <= window ? MSG_DONTWAIT : MSG_WAITFORONE;
+        int n = recvmmsg(fd, in_msgs, max_batch, flags, 0);
+        if ( n > 0) {
+            in_flight -= std::min<size_t>(n, in_flight);
+            blast_received += n;
+        } else if ( flags == MSG_WAITFORONE)
+            in_flight = 0; // the rest got lost
+    }
+    close(fd);
+}
+void run_blast(int thread_count, int seconds, size_t msg_size) {
+    boost::thread_group threads;
+    for ( int i = 0; i < thread_count; ++i)
+        threads.create_thread( boost::bind(blast, msg_size));
+    boost::this_thread::sleep( boost::posix_time::seconds(seconds));
+    blasting = false;
+    threads.join_all();
+    std::cout << "sent " << blast_sent << ", echoed " << blast_received
+              << " datagrams of " << msg_size << " bytes: " 
+              << blast_received / seconds << " echoes/s" << std::endl;
+}
+#else
+void run_blast(int, int, size_t) {
+    std::cerr << "the blaster needs recvmmsg/sendmmsg (Linux)" << std::endl;
+}
+#endif
+
+/** usage: udp_sync_echo_client [--blast [threads [seconds [size]]]]
+    - --blast: floods the server (run it with --batch) from "threads"
+      threads (default 1) for "seconds" (default 5), with datagrams of
+      "size" bytes (default 32)
+*/
 int main(int argc, char* argv[]) {
+    if ( argc > 1 && std::strcmp(argv[1], "--blast") == 0) {
+        int threads = argc > 2 ? std::atoi(argv[2]) : 1;
+        int seconds = argc > 3 ? std::atoi(argv[3]) : 5;
+        size_t size = argc > 4 ? std::atoi(argv[4]) : 32;
+        run_blast(threads > 0 ? threads : 1, seconds > 0 ? seconds : 1, size);
+        return 0;
+    }
     // connect several clients
     char* messages[] = { "John says hi", "so does James", "Lucy just got home", 0 };
     boost::thread_group threads;
@@ -3,8 +3,17 @@
 #include <stdio.h>
 #endif
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
 
-
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
@@ -22,6 +31,83 @@ void handle_connections() {
         sock.send_to(buffer(msg), sender_ep);
     }
 }
+
+#ifdef __linux__
+/** batch mode (Linux): for lots of small datagrams per second
+    - each thread has its own socket on port 8001 (SO_REUSEPORT), so the
+      kernel spreads the datagrams between the threads
+    - one recvmmsg() receives up to max_batch datagrams; one sendmmsg()
+      echoes them all back, straight from the receive buffers
+*/
+boost::atomic<size_t> echoed(0);
+void handle_batches() {
+    enum { max_batch = 64, max_msg = 2048 };
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(8001);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ( bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::cerr << "can't bind: " << std::strerror(errno) << std::endl;
+        return;
+    }
+    char buffs[max_batch][max_msg];
+    sockaddr_in senders[max_batch];
+    iovec iovs[max_batch];
+    mmsghdr msgs[max_batch];
+    while ( true) {
+        std::memset(msgs, 0, sizeof(msgs));
+        for ( int i = 0; i < max_batch; ++i) {
+            iovs[i].iov_base = buffs[i];
+            iovs[i].iov_len = max_msg;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &senders[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+        }
+        // wait for the first, then take whatever else is already there
+        int count = recvmmsg(fd, msgs, max_batch, MSG_WAITFORONE, 0);
+        if ( count <= 0) continue;
+        // echo each one back with the length we got, to whoever sent it
+        for ( int i = 0; i < count; ++i)
+            iovs[i].iov_len = msgs[i].msg_len;
+        for ( int sent = 0; sent < count; ) {
+            int n = sendmmsg(fd, msgs + sent, count - sent, 0);
+            if ( n <= 0) break;
+            sent += n;
+        }
+        echoed += count;
+    }
+}
+void run_batches(int thread_count) {
+    boost::thread_group threads;
+    for ( int i = 0; i < thread_count; ++i)
+        threads.create_thread(handle_batches);
+    size_t last = 0;
+    while ( true) {
+        boost::this_thread::sleep( boost::posix_time::seconds(1));
+        size_t now = echoed;
+        if ( now != last) std::cout << (now - last) << " datagrams/s" << std::endl;
+        last = now;
+    }
+}
+#else
+void run_batches(int) {
+    std::cerr << "batch mode needs recvmmsg/sendmmsg (Linux)" << std::endl;
+}
+#endif
+
+/** usage: udp_sync_echo_server [--batch [threads]]
+    - --batch: recvmmsg/sendmmsg, on "threads" sockets + threads (default:
+      one per core)
+*/
 int main(int argc, char* argv[]) {
+    if ( argc > 1 && std::strcmp(argv[1], "--batch") == 0) {
+        int threads = argc > 2 ? std::atoi(argv[2]) : boost::thread::hardware_concurrency();
+        run_batches(threads > 0 ? threads : 1);
+        return 0;
+    }
     handle_connections();
 }
@@ -4,17 +4,28 @@
 #endif
 
 
+#include <cstring>
+#include <set>
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include "../common/line_buffer.hpp"
+#include "../common/handler_allocator.hpp"
+#include "../common/binary_protocol.hpp"
 using namespace boost::asio;
 io_service service;
+// talk the binary protocol (--binary)
+bool use_binary = false;
 
 #define MEM_FN(x)       boost::bind(&self_type::x, shared_from_this())
 #define MEM_FN1(x,y)    boost::bind(&self_type::x, shared_from_this(),y)
 #define MEM_FN2(x,y,z)  boost::bind(&self_type::x, shared_from_this(),y,z)
+// same, but asio allocates the operation from our handler_allocator_
+#define ALLOC_FN(x)       make_custom_alloc_handler(handler_allocator_, MEM_FN(x))
+#define ALLOC_FN1(x,y)    make_custom_alloc_handler(handler_allocator_, MEM_FN1(x,y))
+#define ALLOC_FN2(x,y,z)  make_custom_alloc_handler(handler_allocator_, MEM_FN2(x,y,z))
 
 /** simple connection to server:
     - logs in just with username (no password)
@@ -24,14 +35,19 @@ io_service service;
     Possible requests:
     - gets a list of all connected clients
     - ping: the server answers either with "ping ok" or "ping client_list_changed"
+
+    We ask for the client list with "ask_clients_since <version>", so that
+    once we have the list, the server only tells us who came and who left.
 */
 class talk_to_svr : public boost::enable_shared_from_this<talk_to_svr>
                   , boost::noncopyable {
     typedef talk_to_svr self_type;
     talk_to_svr(const std::string & username) 
-      : sock_(service), started_(true), username_(username), timer_(service) {}
+      : sock_(service), read_buffer_(max_msg), started_(true), username_(username)
+      , timer_(service), clients_version_(0), binary_(use_binary)
+      , bytes_written_(0), bytes_read_(0) {}
     void start(ip::tcp::endpoint ep) {
-        sock_.async_connect(ep, MEM_FN1(on_connect,_1));
+        sock_.async_connect(ep, ALLOC_FN1(on_connect,_1));
     }
 public:
     typedef boost::system::error_code error_code;
@@ -44,26 +60,84 @@ public:
     }
     void stop() {
         if ( !started_) return;
-        std::cout << "stopping " << username_ << std::endl;
+        std::cout << "stopping " << username_ << " (sent " << bytes_written_ 
+                  << " bytes, received " << bytes_read_ << ")" << std::endl;
         started_ = false;
         sock_.close();
     }
     bool started() { return started_; }
 private:
     void on_connect(const error_code & err) {
-        if ( !err)      do_write("login " + username_ + "\n");
-        else            stop();
+        if ( err)       stop();
+        else if ( binary_) 
+            do_write( std::string(1, char(binary_protocol::handshake))
+                    + binary_protocol::writer(binary_protocol::login).string(username_).frame());
+        else            do_write("login " + username_ + "\n");
     }
     void on_read(const error_code & err, size_t bytes) {
         if ( err) stop();
         if ( !started() ) return;
+        read_buffer_.commit(bytes);
+        bytes_read_ += bytes;
+        if ( binary_) {
+            on_read_frame();
+            return;
+        }
+        std::string msg;
+        if ( !read_buffer_.next_line(msg)) {
+            // message is not full yet
+            if ( read_buffer_.overflow()) stop();
+            else do_read();
+            return;
+        }
         // process the msg
-        std::string msg(read_buffer_, bytes);
         if ( msg.find("login ") == 0) on_login();
         else if ( msg.find("ping") == 0) on_ping(msg);
-        else if ( msg.find("clients ") == 0) on_clients(msg);
+        else if ( msg.find("clients ") == 0) on_clients(msg.substr(8));
+        else if ( msg.find("clients_at ") == 0) on_clients_at(msg);
+        else if ( msg.find("clients_since ") == 0) on_clients_since(msg);
         else std::cerr << "invalid msg " << msg << std::endl;
     }
+    void on_read_frame() {
+        binary_protocol::frame_view f;
+        binary_protocol::frame_result result = binary_protocol::next_frame(read_buffer_, f);
+        if ( result != binary_protocol::frame_ok) {
+            // message is not full yet
+            if ( result == binary_protocol::frame_invalid) stop();
+            else do_read();
+            return;
+        }
+        binary_protocol::reader in(f.data, f.size);
+        switch ( f.op) {
+        case binary_protocol::login_ok:     on_login(); break;
+        case binary_protocol::ping_ok:      postpone_ping(); break;
+        case binary_protocol::ping_changed: do_ask_clients(); break;
+        case binary_protocol::clients:
+            known_clients_.clear();
+            on_clients( read_names(in));
+            break;
+        case binary_protocol::clients_at:
+            in.varint(clients_version_);
+            known_clients_.clear();
+            read_names(in);
+            on_clients_changed();
+            break;
+        case binary_protocol::clients_since: on_clients_since(in); break;
+        default: std::cerr << "invalid msg, opcode " << int(f.op) << std::endl;
+        }
+    }
+    // <count> <names> - also puts the names in known_clients_
+    std::string read_names(binary_protocol::reader & in) {
+        std::string names;
+        const char * name;
+        size_t count = 0, len;
+        in.varint(count);
+        for ( ; count > 0 && in.string(name, len); --count) {
+            known_clients_.insert( std::string(name, len));
+            names.append(name, len) += " ";
+        }
+        return names;
+    }
     
     void on_login() {
         std::cout << username_ << " logged in" << std::endl;
@@ -76,14 +150,59 @@ private:
         if ( answer == "client_list_changed") do_ask_clients();
         else postpone_ping();
     }
-    void on_clients(const std::string & msg) {
-        std::string clients = msg.substr(8);
-        std::cout << username_ << ", new client list:" << clients ;
+    void on_clients(const std::string & clients) {
+        std::cout << username_ << ", new client list:" << clients << std::endl;
+        postpone_ping();
+    }
+    // the whole list
+    void on_clients_at(const std::string & msg) {
+        std::istringstream in(msg);
+        std::string name;
+        in >> name >> clients_version_;
+        known_clients_.clear();
+        while ( in >> name)
+            known_clients_.insert(name);
+        on_clients_changed();
+    }
+    // who came ("+name") and who left ("-name") since the version we knew
+    void on_clients_since(const std::string & msg) {
+        std::istringstream in(msg);
+        std::string name;
+        in >> name >> clients_version_;
+        while ( in >> name) {
+            if ( name[0] == '+') known_clients_.insert(name.substr(1));
+            else {
+                std::multiset<std::string>::iterator found = known_clients_.find(name.substr(1));
+                if ( found != known_clients_.end()) known_clients_.erase(found);
+            }
+        }
+        on_clients_changed();
+    }
+    void on_clients_since(binary_protocol::reader & in) {
+        const char * name;
+        size_t count = 0, len;
+        unsigned char added;
+        in.varint(clients_version_);
+        in.varint(count);
+        for ( ; count > 0 && in.byte(added) && in.string(name, len); --count) {
+            if ( added) known_clients_.insert( std::string(name, len));
+            else {
+                std::multiset<std::string>::iterator found = known_clients_.find( std::string(name, len));
+                if ( found != known_clients_.end()) known_clients_.erase(found);
+            }
+        }
+        on_clients_changed();
+    }
+    void on_clients_changed() {
+        std::string clients;
+        for ( std::multiset<std::string>::const_iterator b = known_clients_.begin(), e = known_clients_.end(); b != e; ++b)
+            clients += *b + " ";
+        std::cout << username_ << ", new client list:" << clients << std::endl;
         postpone_ping();
     }
 
     void do_ping() {
-        do_write("ping\n");
+        do_write(binary_ ? binary_protocol::frame(binary_protocol::ping) : "ping\n");
     }
     void postpone_ping() {
         // note: even though the server wants a ping every 5 secs, we randomly 
@@ -92,43 +211,60 @@ private:
         std::cout << username_ << " postponing ping " << millis 
                   << " millis" << std::endl;
         timer_.expires_from_now(boost::posix_time::millisec(millis));
-        timer_.async_wait( MEM_FN(do_ping));
+        timer_.async_wait( ALLOC_FN(do_ping));
     }
     void do_ask_clients() {
-        do_write("ask_clients\n");
+        if ( binary_) {
+            do_write( binary_protocol::writer(binary_protocol::ask_clients_since)
+                      .varint(clients_version_).frame());
+            return;
+        }
+        std::ostringstream out;
+        out << "ask_clients_since " << clients_version_ << "\n";
+        do_write(out.str());
     }
 
     void on_write(const error_code & err, size_t bytes) {
+        bytes_written_ += bytes;
         do_read();
     }
     void do_read() {
-        async_read(sock_, buffer(read_buffer_), 
-                   MEM_FN2(read_complete,_1,_2), MEM_FN2(on_read,_1,_2));
+        if ( binary_ ? binary_protocol::has_frame(read_buffer_) : read_buffer_.has_line())
+            // already got the answer with a previous read
+            service.post( MEM_FN2(on_read,error_code(),0));
+        else
+            sock_.async_read_some(read_buffer_.prepare(), ALLOC_FN2(on_read,_1,_2));
     }
     void do_write(const std::string & msg) {
         if ( !started() ) return;
         std::copy(msg.begin(), msg.end(), write_buffer_);
         sock_.async_write_some( buffer(write_buffer_, msg.size()), 
-                                MEM_FN2(on_write,_1,_2));
-    }
-    size_t read_complete(const boost::system::error_code & err, size_t bytes) {
-        if ( err) return 0;
-        bool found = std::find(read_buffer_, read_buffer_ + bytes, '\n') < read_buffer_ + bytes;
-        // we read one-by-one until we get to enter, no buffering
-        return found ? 0 : 1;
+                                ALLOC_FN2(on_write,_1,_2));
     }
 
 private:
+    // must outlive sock_ and timer_ - closing them frees the pending operations
+    handler_allocator handler_allocator_;
     ip::tcp::socket sock_;
     enum { max_msg = 1024 };
-    char read_buffer_[max_msg];
+    line_buffer read_buffer_;
     char write_buffer_[max_msg];
     bool started_;
     std::string username_;
     deadline_timer timer_;
+    // the client list, as of clients_version_
+    size_t clients_version_;
+    std::multiset<std::string> known_clients_;
+    bool binary_;
+    size_t bytes_written_, bytes_read_;
 };
 
+/** usage: async_client [--binary]
+    - --binary: talk the binary protocol (see binary_protocol.hpp)
+*/
 int main(int argc, char* argv[]) {
+    for ( int i = 1; i < argc; ++i)
+        if ( std::strcmp(argv[i], "--binary") == 0) use_binary = true;
     // connect several clients
     ip::tcp::endpoint ep( ip::address::from_string("127.0.0.1"), 8001);
     char* names[] = { "John", "James", "Lucy", "Tracy", "Frank", "Abby", 0 };
@@ -3,28 +3,49 @@
 #include <stdio.h>
 #endif
 
-
+#include <cstdlib>
 
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "../common/line_buffer.hpp"
+#include "../common/handler_allocator.hpp"
+#include "../common/text_protocol.hpp"
+#include "../common/write_queue.hpp"
+#include "../common/binary_protocol.hpp"
+#include "../common/client_registry.hpp"
+#include "../common/client_list.hpp"
+#include "../common/timing_wheel.hpp"
+#include "../common/object_pool.hpp"
+#include "../common/server_stats.hpp"
+#include "../common/async_log.hpp"
 using namespace boost::asio;
 using namespace boost::posix_time;
 io_service service;
 
 class talk_to_client;
 typedef boost::shared_ptr<talk_to_client> client_ptr;
-typedef std::vector<client_ptr> array;
-array clients;
+client_registry<talk_to_client> clients;
+// the usernames, with the answer to ask_clients built once per change
+client_list client_names;
+// clients that haven't pinged for 5 seconds (checked every 100 ms)
+void on_idle_clients(const std::vector<client_ptr> & idle);
+timing_wheel<talk_to_client> idle_clients(5000, 100, on_idle_clients);
+// talk_to_client objects are reused, not created for every accept
+typedef object_pool<talk_to_client> session_pool;
+boost::scoped_ptr<session_pool> sessions;
 
 #define MEM_FN(x)       boost::bind(&self_type::x, shared_from_this())
 #define MEM_FN1(x,y)    boost::bind(&self_type::x, shared_from_this(),y)
 #define MEM_FN2(x,y,z)  boost::bind(&self_type::x, shared_from_this(),y,z)
+// same, but asio allocates the operation from our handler_allocator_
+#define ALLOC_FN(x)       make_custom_alloc_handler(handler_allocator_, MEM_FN(x))
+#define ALLOC_FN1(x,y)    make_custom_alloc_handler(handler_allocator_, MEM_FN1(x,y))
+#define ALLOC_FN2(x,y,z)  make_custom_alloc_handler(handler_allocator_, MEM_FN2(x,y,z))
 
 
-void update_clients_changed();
-
 /** simple connection to server:
     - logs in just with username (no password)
     - all connections are initiated by the client: client asks, server answers
@@ -33,70 +54,175 @@ void update_clients_changed();
     Possible client requests:
     - gets a list of all connected clients
     - ping: the server answers either with "ping ok" or "ping client_list_changed"
+    - stats: the server's counters (see server_stats.hpp)
+
+    A client can talk the binary protocol instead (see binary_protocol.hpp),
+    by sending the handshake byte first.
 */
 class talk_to_client : public boost::enable_shared_from_this<talk_to_client>
-                     , boost::noncopyable {
+                     , public registry_hook
+                     , public timing_wheel<talk_to_client>::entry, boost::noncopyable {
     typedef talk_to_client self_type;
-    talk_to_client() : sock_(service), started_(false), 
-                       timer_(service), clients_changed_(false) {
+    talk_to_client() : sock_(service), read_buffer_(max_msg), started_(false), 
+                       protocol_known_(false), binary_(false), clients_version_(0) {
     }
 public:
     typedef boost::system::error_code error_code;
     typedef boost::shared_ptr<talk_to_client> ptr;
+    typedef server_stats::value_type value_type;
 
     void start() {
         started_ = true;
-        clients.push_back( shared_from_this());
-        last_ping = boost::posix_time::microsec_clock::local_time();
+        server_stats::count(server_stats::accepted);
+        clients.add( shared_from_this());
+        clients_version_ = client_names.version();
+        idle_clients.arm(*this);
         // first, we wait for client to login
         do_read();
     }
     static ptr new_() {
-        ptr new_(new talk_to_client);
-        return new_;
+        return sessions->acquire();
+    }
+    static talk_to_client * create() { return new talk_to_client; }
+    // the pool calls this once nobody uses us anymore, before reusing us
+    void reset() {
+        error_code err;
+        sock_.close(err);
+        read_buffer_.clear();
+        server_stats::count(server_stats::queued_bytes, -value_type(write_queue_.bytes()));
+        write_queue_.clear();
+        started_ = false;
+        protocol_known_ = binary_ = false;
+        username_.clear();
+        clients_version_ = 0;
     }
     void stop() {
         if ( !started_) return;
         started_ = false;
+        server_stats::count(server_stats::closed);
         sock_.close();
+        idle_clients.disarm(*this);
 
         ptr self = shared_from_this();
-        array::iterator it = std::find(clients.begin(), clients.end(), self);
-        clients.erase(it);
-        update_clients_changed();
+        clients.remove(self);
+        client_names.remove( connection_id());
     }
     bool started() const { return started_; }
     ip::tcp::socket & sock() { return sock_;}
     std::string username() const { return username_; }
-    void set_clients_changed() { clients_changed_ = true; }
 private:
     void on_read(const error_code & err, size_t bytes) {
         if ( err) stop();
         if ( !started() ) return;
-        // process the msg
-        std::string msg(read_buffer_, bytes);
-        if ( msg.find("login ") == 0) on_login(msg);
-        else if ( msg.find("ping") == 0) on_ping();
-        else if ( msg.find("ask_clients") == 0) on_clients();
-        else std::cerr << "invalid msg " << msg << std::endl;
+        read_buffer_.commit(bytes);
+        server_stats::count(server_stats::bytes_in, bytes);
+        if ( !protocol_known_ && read_buffer_.size() > 0) {
+            // binary clients tell us with their very first byte
+            protocol_known_ = true;
+            binary_ = static_cast<unsigned char>(*read_buffer_.data()) == binary_protocol::handshake;
+            if ( binary_) read_buffer_.consume(1);
+        }
+        // process every msg we already have - the answers go out in one write
+        if ( !(binary_ ? on_frames() : on_lines())) {
+            async_log::limited(async_log::warning, "invalid msg - too long");
+            server_stats::count(server_stats::invalid);
+            stop();
+            return;
+        }
+        if ( !started() ) return;
+        if ( write_queue_.pending()) flush_write();
+        else do_read(); // message is not full yet
     }
     
-    void on_login(const std::string & msg) {
-        std::istringstream in(msg);
-        in >> username_ >> username_;
-        std::cout << username_ << " logged in" << std::endl;
-        do_write("login ok\n");
-        update_clients_changed();
+    // false if the client sent something we can't handle
+    bool on_lines() {
+        const char * line;
+        size_t len;
+        while ( read_buffer_.next_line(line, len)) {
+            idle_clients.touch(*this);
+            text_protocol::string_ref args;
+            text_protocol::command command = text_protocol::parse( text_protocol::string_ref(line, len), args);
+            server_stats::count_command(command);
+            switch ( command) {
+            case text_protocol::login:              on_login(args); break;
+            case text_protocol::ping:               on_ping(); break;
+            case text_protocol::ask_clients:        on_clients(); break;
+            case text_protocol::ask_clients_since:  on_clients_since(args); break;
+            case text_protocol::stats:              on_stats(); break;
+            default: async_log::limited(async_log::warning, "invalid msg {}", async_log::text(line, len));
+            }
+        }
+        return !read_buffer_.overflow();
+    }
+    bool on_frames() {
+        binary_protocol::frame_view f;
+        binary_protocol::frame_result result;
+        while ( (result = binary_protocol::next_frame(read_buffer_, f)) == binary_protocol::frame_ok) {
+            idle_clients.touch(*this);
+            binary_protocol::reader in(f.data, f.size);
+            const char * name;
+            size_t len, since;
+            server_stats::count_command( binary_protocol::to_command(f.op));
+            switch ( f.op) {
+            case binary_protocol::login:
+                if ( in.string(name, len)) login( std::string(name, len));
+                break;
+            case binary_protocol::ping:                 on_ping(); break;
+            case binary_protocol::ask_clients:          on_clients(); break;
+            case binary_protocol::ask_clients_since:
+                if ( in.varint(since)) clients_since(since);
+                break;
+            case binary_protocol::stats:                on_stats(); break;
+            default: async_log::limited(async_log::warning, "invalid msg, opcode {}", int(f.op));
+            }
+        }
+        return result != binary_protocol::frame_invalid;
+    }
+    
+    void on_login(text_protocol::string_ref args) {
+        text_protocol::string_ref name;
+        if ( text_protocol::next_word(args, name)) login( name.to_string());
+        else {
+            async_log::limited(async_log::warning, "invalid msg - login without a name");
+            server_stats::count(server_stats::invalid);
+        }
+    }
+    void login(const std::string & username) {
+        username_ = username;
+        async_log::log(async_log::info, "{} logged in", username_);
+        client_names.add( connection_id(), username_);
+        do_write(binary_ ? binary_protocol::frame(binary_protocol::login_ok) : "login ok\n");
     }
     void on_ping() {
-        do_write(clients_changed_ ? "ping client_list_changed\n" : "ping ok\n");
-        clients_changed_ = false;
+        // did anybody log in/out since our last ping?
+        size_t version = client_names.version();
+        bool changed = version != clients_version_;
+        clients_version_ = version;
+        if ( binary_) 
+            do_write( binary_protocol::frame(changed ? binary_protocol::ping_changed : binary_protocol::ping_ok));
+        else
+            do_write(changed ? "ping client_list_changed\n" : "ping ok\n");
     }
     void on_clients() {
-        std::string msg;
-        for( array::const_iterator b = clients.begin(), e = clients.end() ; b != e; ++b)
-            msg += (*b)->username() + " ";
-        do_write("clients " + msg + "\n");
+        client_list::snapshot_ptr clients = client_names.current();
+        do_write(binary_ ? clients->binary : clients->answer);
+    }
+    void on_clients_since(text_protocol::string_ref args) {
+        text_protocol::string_ref word;
+        size_t since = 0;
+        if ( text_protocol::next_word(args, word)) text_protocol::to_number(word, since);
+        clients_since(since);
+    }
+    void clients_since(size_t since) {
+        std::string answer;
+        if ( client_names.delta(since, answer, binary_)) do_write(answer);
+        else if ( binary_) do_write(client_names.current()->binary_versioned);
+        else do_write(client_names.current()->versioned);
+    }
+    void on_stats() {
+        std::string stats = server_stats::collect().text();
+        if ( binary_) do_write( binary_protocol::writer(binary_protocol::stats_answer).string(stats).frame());
+        else do_write("stats " + stats + "\n");
     }
 
     void do_ping() {
@@ -106,68 +232,96 @@ private:
         do_write("ask_clients\n");
     }
 
-    void on_check_ping() {
-        boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
-        if ( (now - last_ping).total_milliseconds() > 5000) {
-            std::cout << "stopping " << username_ << " - no ping in time" << std::endl;
-            stop();
-        }
-        last_ping = boost::posix_time::microsec_clock::local_time();
-    }
-    void post_check_ping() {
-        timer_.expires_from_now(boost::posix_time::millisec(5000));
-        timer_.async_wait( MEM_FN(on_check_ping));
-    }
-
-
     void on_write(const error_code & err, size_t bytes) {
-        do_read();
+        server_stats::count(server_stats::bytes_out, bytes);
+        size_t queued = write_queue_.bytes();
+        write_queue_.end_write();
+        server_stats::count(server_stats::queued_bytes, value_type(write_queue_.bytes()) - value_type(queued));
+        if ( err) stop();
+        else if ( write_queue_.pending()) flush_write();
+        else do_read();
     }
     void do_read() {
-        async_read(sock_, buffer(read_buffer_), 
-                   MEM_FN2(read_complete,_1,_2), MEM_FN2(on_read,_1,_2));
-        post_check_ping();
+        sock_.async_read_some(read_buffer_.prepare(), ALLOC_FN2(on_read,_1,_2));
     }
     void do_write(const std::string & msg) {
         if ( !started() ) return;
-        std::copy(msg.begin(), msg.end(), write_buffer_);
-        sock_.async_write_some( buffer(write_buffer_, msg.size()), 
-                                MEM_FN2(on_write,_1,_2));
+        // sent by flush_write(), once all buffered requests are answered
+        if ( !write_queue_.push(msg)) {
+            async_log::limited(async_log::warning, "{} doesn't read its answers", username_);
+            stop();
+            return;
+        }
+        server_stats::count(server_stats::queued_bytes, msg.size());
+        server_stats::queue_depth(write_queue_.bytes());
     }
-    size_t read_complete(const boost::system::error_code & err, size_t bytes) {
-        if ( err) return 0;
-        bool found = std::find(read_buffer_, read_buffer_ + bytes, '\n') < read_buffer_ + bytes;
-        // we read one-by-one until we get to enter, no buffering
-        return found ? 0 : 1;
+    void flush_write() {
+        if ( !started() || write_queue_.writing() || !write_queue_.pending()) return;
+        async_write(sock_, write_queue_.start_write(), ALLOC_FN2(on_write,_1,_2));
     }
 private:
+    // must outlive sock_ - closing it frees the pending operations
+    handler_allocator handler_allocator_;
     ip::tcp::socket sock_;
     enum { max_msg = 1024 };
-    char read_buffer_[max_msg];
-    char write_buffer_[max_msg];
+    line_buffer read_buffer_;
+    write_queue write_queue_;
     bool started_;
+    // text or binary protocol - decided by the client's first byte
+    bool protocol_known_, binary_;
     std::string username_;
-    deadline_timer timer_;
-    boost::posix_time::ptime last_ping;
-    bool clients_changed_;
+    // client_names.version() as of our last ping
+    size_t clients_version_;
 };
 
-void update_clients_changed() {
-    for( array::iterator b = clients.begin(), e = clients.end(); b != e; ++b)
-        (*b)->set_clients_changed();
+void on_idle_clients(const std::vector<client_ptr> & idle) {
+    for ( std::vector<client_ptr>::const_iterator b = idle.begin(), e = idle.end(); b != e; ++b) {
+        async_log::log(async_log::info, "stopping {} - no ping in time", (*b)->username());
+        server_stats::count(server_stats::timed_out);
+        (*b)->stop();
+    }
 }
 
 ip::tcp::acceptor acceptor(service, ip::tcp::endpoint(ip::tcp::v4(), 8001));
 
+void handle_accept(talk_to_client::ptr client, const boost::system::error_code & err);
+// only the pending accept holds the new client - if it never starts, it
+// goes back to the pool with the handler
+void start_accept() {
+    talk_to_client::ptr client = talk_to_client::new_();
+    acceptor.async_accept(client->sock(), boost::bind(handle_accept,client,_1));
+}
 void handle_accept(talk_to_client::ptr client, const boost::system::error_code & err) {
-    client->start();
-    talk_to_client::ptr new_client = talk_to_client::new_();
-    acceptor.async_accept(new_client->sock(), boost::bind(handle_accept,new_client,_1));
+    if ( !err) client->start();
+    start_accept();
 }
 
 
+/** usage: async_server [--warm-up count] [--grow-by count] [--stats secs]
+                        [--log level]
+    - we create "warm-up" clients up front (default 256), and when
+      we run out, "grow-by" more at once (default 64)
+    - --stats: print the counters every "secs" seconds (clients can ask
+      for them any time, with "stats")
+    - --log: the least important messages to print - debug, info (the
+      default), warning, error or off
+*/
 int main(int argc, char* argv[]) {
-    talk_to_client::ptr client = talk_to_client::new_();
-    acceptor.async_accept(client->sock(), boost::bind(handle_accept,client,_1));
+    size_t warm_up = 256, grow_by = 64;
+    int stats_secs = 0;
+    for ( int i = 1; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if ( arg == "--warm-up") warm_up = atoi(argv[++i]);
+        else if ( arg == "--grow-by") grow_by = atoi(argv[++i]);
+        else if ( arg == "--stats") stats_secs = atoi(argv[++i]);
+        else if ( arg == "--log") {
+            async_log::level l;
+            if ( async_log::parse_level(argv[++i], l)) async_log::set_level(l);
+        }
+    }
+    server_stats::dump_every(stats_secs);
+    sessions.reset( new session_pool(talk_to_client::create, warm_up, grow_by));
+    start_accept();
+    idle_clients.start(service);
     service.run();
 }
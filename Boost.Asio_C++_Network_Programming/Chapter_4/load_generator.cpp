@@ -0,0 +1,636 @@
+#ifdef WIN32
+#define _WIN32_WINNT 0x0501
+#include <stdio.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+#include "../common/line_buffer.hpp"
+#include "../common/handler_allocator.hpp"
+#include "../common/write_queue.hpp"
+#include "../common/io_service_pool.hpp"
+#include "../common/latency_histogram.hpp"
+using namespace boost::asio;
+typedef boost::chrono::steady_clock clock_type;
+
+inline boost::uint64_t to_micros(clock_type::duration d) {
+    return boost::chrono::duration_cast<boost::chrono::microseconds>(d).count();
+}
+
+#define MEM_FN(x)       boost::bind(&self_type::x, shared_from_this())
+#define MEM_FN1(x,y)    boost::bind(&self_type::x, shared_from_this(),y)
+#define MEM_FN2(x,y,z)  boost::bind(&self_type::x, shared_from_this(),y,z)
+// same, but asio allocates the operation from our handler_allocator_
+#define ALLOC_FN(x)       make_custom_alloc_handler(handler_allocator_, MEM_FN(x))
+#define ALLOC_FN1(x,y)    make_custom_alloc_handler(handler_allocator_, MEM_FN1(x,y))
+#define ALLOC_FN2(x,y,z)  make_custom_alloc_handler(handler_allocator_, MEM_FN2(x,y,z))
+
+enum command { login, ping, ask_clients, command_count };
+const char * command_names[command_count] = { "login", "ping", "ask_clients" };
+
+// the mix is deterministic: with 90,10 - 90 pings, then 10 ask_clients
+inline command pick_command(const std::vector<int> & mix, boost::uint64_t i) {
+    return int(i % (mix[0] + mix[1])) < mix[0] ? ping : ask_clients;
+}
+
+// what we know about one command
+struct command_stats {
+    command_stats() : sent(0), answered(0), errors(0) {}
+    void merge(const command_stats & other) {
+        latency.merge(other.latency);
+        sent += other.sent;
+        answered += other.answered;
+        errors += other.errors;
+    }
+    void reset() {
+        latency.reset();
+        sent = answered = errors = 0;
+    }
+    latency_histogram latency;
+    size_t sent, answered, errors;
+};
+
+/** the numbers of one loop - since the start, and since the last report
+
+    Only the loop's thread records, and the reporter takes the numbers
+    once per interval - so the lock is hardly ever contended.
+*/
+struct loop_stats {
+    void sent(command c) {
+        boost::mutex::scoped_lock lk(cs);
+        ++total[c].sent; ++interval[c].sent;
+    }
+    void answered(command c, boost::uint64_t micros) {
+        boost::mutex::scoped_lock lk(cs);
+        ++total[c].answered; ++interval[c].answered;
+        total[c].latency.record(micros);
+        interval[c].latency.record(micros);
+    }
+    void failed(command c) {
+        boost::mutex::scoped_lock lk(cs);
+        ++total[c].errors; ++interval[c].errors;
+    }
+    // adds the numbers since the last report to "to", and starts over
+    void take_interval(command_stats * to) {
+        boost::mutex::scoped_lock lk(cs);
+        for ( int c = 0; c < command_count; ++c) {
+            to[c].merge(interval[c]);
+            interval[c].reset();
+        }
+    }
+    void take_total(command_stats * to) {
+        boost::mutex::scoped_lock lk(cs);
+        for ( int c = 0; c < command_count; ++c)
+            to[c].merge(total[c]);
+    }
+
+    boost::mutex cs;
+    command_stats total[command_count], interval[command_count];
+};
+
+/** one session of the load generator - a client that does as it's told:
+    - connects, logs in, then sends whatever the driver asks for
+    - requests are pipelined: we don't wait for an answer before sending
+      the next request, so a slow server can't slow the load down
+    - answers come in the order of the requests, so each one is matched
+      with the oldest pending request; its latency is measured from the
+      time the request was *due*, not from when we got to send it
+    - answers to ask_clients grow with the number of clients; we don't
+      need the names, so a line longer than our buffer is skipped
+    - keep_busy(): a closed loop instead - every answer is followed by the
+      next request, so "depth" requests are always pending
+*/
+class load_session : public boost::enable_shared_from_this<load_session>
+                   , boost::noncopyable {
+    typedef load_session self_type;
+public:
+    typedef boost::system::error_code error_code;
+    typedef boost::shared_ptr<load_session> ptr;
+    enum state_type { idle, connecting, logging_in, ready, closed };
+
+    load_session(io_service & service, loop_stats & stats, const std::string & username)
+        : sock_(service), read_buffer_(max_msg, max_msg * 4), stats_(stats)
+        , username_(username), state_(idle), skipping_(false), skip_valid_(false)
+        , busy_(false), busy_count_(0) {}
+
+    void start(ip::tcp::endpoint ep) {
+        state_ = connecting;
+        sock_.async_connect(ep, ALLOC_FN1(on_connect,_1));
+    }
+    // sends a request; "due" is when it should have been sent
+    void send(command c, clock_type::time_point due, bool measured = true) {
+        if ( measured) stats_.sent(c);
+        if ( state_ != ready) {
+            if ( measured) stats_.failed(c);
+            return;
+        }
+        pending_.push_back( pending(c, due, measured));
+        do_write(c == ping ? "ping\n" : "ask_clients\n");
+    }
+    void keep_busy(const std::vector<int> & mix, size_t depth) {
+        busy_ = true;
+        mix_ = mix;
+        for ( size_t i = 0; i < depth; ++i)
+            send( pick_command(mix_, busy_count_++), clock_type::now());
+    }
+    void stop_busy() { busy_ = false; }
+    void stop() {
+        if ( state_ == closed) return;
+        state_ = closed;
+        // whatever we were waiting for won't come
+        for ( size_t i = 0; i < pending_.size(); ++i)
+            if ( pending_[i].measured) stats_.failed(pending_[i].c);
+        pending_.clear();
+        error_code err;
+        sock_.close(err);
+    }
+    state_type state() const { return state_; }
+    clock_type::time_point last_sent() const { return last_sent_; }
+private:
+    void on_connect(const error_code & err) {
+        if ( err) {
+            stats_.sent(login);
+            stats_.failed(login);
+            stop();
+            return;
+        }
+        ip::tcp::no_delay no_delay(true);
+        error_code ignore;
+        sock_.set_option(no_delay, ignore);
+        state_ = logging_in;
+        stats_.sent(login);
+        pending_.push_back( pending(login, clock_type::now(), true));
+        do_write("login " + username_ + "\n");
+        do_read();
+    }
+    void do_read() {
+        sock_.async_read_some(read_buffer_.prepare(), ALLOC_FN2(on_read,_1,_2));
+    }
+    void on_read(const error_code & err, size_t bytes) {
+        if ( err) { stop(); return; }
+        read_buffer_.commit(bytes);
+        const char * line; size_t len;
+        while ( state_ != closed && read_buffer_.next_line(line, len)) {
+            if ( skipping_) {
+                skipping_ = false;
+                on_answer(skip_valid_);
+            } else
+                on_answer( valid_answer(line, len));
+        }
+        if ( state_ == closed) return;
+        if ( read_buffer_.overflow()) {
+            // a long answer (the client list) - we just wait for its end
+            if ( !skipping_) skip_valid_ = valid_answer(read_buffer_.data(), read_buffer_.size());
+            skipping_ = true;
+            read_buffer_.consume( read_buffer_.size());
+        }
+        do_read();
+    }
+    bool valid_answer(const char * line, size_t len) const {
+        if ( pending_.empty()) return false;
+        const char * expected = pending_.front().c == login ? "login ok"
+                              : pending_.front().c == ping ? "ping" : "clients";
+        size_t expected_len = std::strlen(expected);
+        return len >= expected_len && std::memcmp(line, expected, expected_len) == 0;
+    }
+    void on_answer(bool valid) {
+        if ( pending_.empty() || !valid) {
+            // the server talks nonsense - don't trust the rest either
+            stop();
+            return;
+        }
+        pending p = pending_.front();
+        pending_.pop_front();
+        if ( p.measured)
+            stats_.answered(p.c, to_micros(clock_type::now() - p.due));
+        if ( p.c == login) state_ = ready;
+        else if ( p.measured && busy_)
+            send( pick_command(mix_, busy_count_++), clock_type::now());
+    }
+
+    void do_write(const std::string & msg) {
+        last_sent_ = clock_type::now();
+        if ( !write_queue_.push(msg)) stop();
+        else if ( !write_queue_.writing())
+            async_write(sock_, write_queue_.start_write(), ALLOC_FN2(on_write,_1,_2));
+    }
+    void on_write(const error_code & err, size_t) {
+        write_queue_.end_write();
+        if ( err) stop();
+        else if ( write_queue_.pending())
+            async_write(sock_, write_queue_.start_write(), ALLOC_FN2(on_write,_1,_2));
+    }
+private:
+    struct pending {
+        pending(command c, clock_type::time_point due, bool measured)
+            : c(c), due(due), measured(measured) {}
+        command c;
+        clock_type::time_point due;
+        bool measured;
+    };
+    // must outlive sock_ - closing it frees the pending operations
+    handler_allocator handler_allocator_;
+    ip::tcp::socket sock_;
+    enum { max_msg = 1024 };
+    line_buffer read_buffer_;
+    write_queue write_queue_;
+    std::deque<pending> pending_;
+    loop_stats & stats_;
+    std::string username_;
+    state_type state_;
+    clock_type::time_point last_sent_;
+    // in the middle of a line longer than max_msg
+    bool skipping_, skip_valid_;
+    // closed loop (keep_busy)
+    bool busy_;
+    std::vector<int> mix_;
+    boost::uint64_t busy_count_;
+};
+
+/** drives the sessions of one loop, from a timer:
+    - first, connects them at connect_rate per second
+    - then, once load() is called, sends requests at a fixed rate, no
+      matter how fast the server answers (an open loop): request i is due
+      at start + i / rate, and goes to the next session, round-robin; the
+      timer wakes us up when the next request is due (or in 1 ms, for
+      the rest)
+    - with a rate of 0, each session keeps "depth" requests pending
+      instead (a closed loop) - this measures how much the server can take
+    - sessions that have been quiet for 2 seconds get a ping that isn't
+      measured, or the server would disconnect them
+*/
+class load_driver : boost::noncopyable {
+public:
+    load_driver(io_service & service, ip::tcp::endpoint ep, double connect_rate,
+                const std::vector<int> & mix, size_t depth)
+        : service_(service), timer_(service), ep_(ep), connect_rate_(connect_rate)
+        , mix_(mix), depth_(depth), connected_(0), loading_(false), rate_(0), issued_(0), next_(0)
+        , ready_(0), failed_(0) {}
+
+    void add(load_session::ptr session) { sessions_.push_back(session); }
+    loop_stats & stats() { return stats_; }
+    // how many sessions are logged in / gave up (callable from any thread)
+    size_t ready() const { return ready_; }
+    size_t failed() const { return failed_; }
+
+    void start() {
+        service_.post( boost::bind(&load_driver::do_start, this));
+    }
+    // from now on, "rate" requests per second, counting from "start"
+    // (0 = as many as the server answers)
+    void load(double rate, clock_type::time_point start) {
+        service_.post( boost::bind(&load_driver::do_load, this, rate, start));
+    }
+    void stop_load() {
+        service_.post( boost::bind(&load_driver::do_stop_load, this));
+    }
+    void stop() {
+        service_.post( boost::bind(&load_driver::do_stop, this));
+    }
+private:
+    void do_start() {
+        started_ = last_check_ = last_count_ = last_keep_alive_ = clock_type::now();
+        tick();
+    }
+    void do_load(double rate, clock_type::time_point start) {
+        loading_ = rate > 0;
+        rate_ = rate;
+        load_start_ = start;
+        issued_ = 0;
+        if ( rate <= 0)
+            for ( size_t i = 0; i < sessions_.size(); ++i)
+                if ( sessions_[i]->state() == load_session::ready)
+                    sessions_[i]->keep_busy(mix_, depth_);
+    }
+    void do_stop_load() {
+        loading_ = false;
+        for ( size_t i = 0; i < sessions_.size(); ++i) sessions_[i]->stop_busy();
+    }
+    void do_stop() {
+        timer_.cancel();
+        for ( size_t i = 0; i < sessions_.size(); ++i) sessions_[i]->stop();
+    }
+
+    clock_type::time_point due_at(boost::uint64_t i) const {
+        return load_start_ + boost::chrono::microseconds( boost::uint64_t(i * 1e6 / rate_));
+    }
+    void tick() {
+        long wait = 1000;
+        if ( loading_) {
+            long next = long( to_micros( due_at(issued_) - clock_type::now()));
+            wait = std::max(0L, std::min(wait, next));
+        }
+        timer_.expires_from_now( boost::posix_time::microseconds(wait));
+        timer_.async_wait( boost::bind(&load_driver::on_tick, this, _1));
+    }
+    void on_tick(const boost::system::error_code & err) {
+        if ( err) return;
+        clock_type::time_point now = clock_type::now();
+        if ( loading_) send_due(now);
+        if ( now - last_check_ >= boost::chrono::milliseconds(1)) {
+            connect_more(now);
+            last_check_ = now;
+        }
+        if ( now - last_count_ >= boost::chrono::milliseconds(10)) {
+            count_sessions();
+            last_count_ = now;
+        }
+        if ( now - last_keep_alive_ >= boost::chrono::seconds(1)) {
+            keep_alive(now);
+            last_keep_alive_ = now;
+        }
+        tick();
+    }
+    void connect_more(clock_type::time_point now) {
+        double secs = to_micros(now - started_) / 1e6;
+        size_t due = connect_rate_ > 0 ? size_t(secs * connect_rate_) + 1 : sessions_.size();
+        for ( ; connected_ < sessions_.size() && connected_ < due; ++connected_)
+            sessions_[connected_]->start(ep_);
+    }
+    void send_due(clock_type::time_point now) {
+        if ( sessions_.empty()) return;
+        for ( ; due_at(issued_) <= now; ++issued_)
+            sessions_[next_++ % sessions_.size()]->send( pick_command(mix_, issued_), due_at(issued_));
+    }
+    void keep_alive(clock_type::time_point now) {
+        for ( size_t i = 0; i < sessions_.size(); ++i)
+            if ( sessions_[i]->state() == load_session::ready
+                    && now - sessions_[i]->last_sent() >= boost::chrono::seconds(2))
+                sessions_[i]->send(ping, now, false);
+    }
+    void count_sessions() {
+        size_t ready = 0, failed = 0;
+        for ( size_t i = 0; i < connected_; ++i)
+            if ( sessions_[i]->state() == load_session::ready) ++ready;
+            else if ( sessions_[i]->state() == load_session::closed) ++failed;
+        ready_ = ready;
+        failed_ = failed;
+    }
+private:
+    io_service & service_;
+    deadline_timer timer_;
+    ip::tcp::endpoint ep_;
+    double connect_rate_;
+    std::vector<int> mix_;
+    size_t depth_;
+    std::vector<load_session::ptr> sessions_;
+    size_t connected_;
+    loop_stats stats_;
+    clock_type::time_point started_, last_check_, last_count_, last_keep_alive_;
+    bool loading_;
+    double rate_;
+    clock_type::time_point load_start_;
+    boost::uint64_t issued_;
+    size_t next_;
+    boost::atomic<size_t> ready_, failed_;
+};
+
+// one line of the report over time
+struct interval_row {
+    double t;
+    size_t sent, answered, errors;
+    double rate;
+    boost::uint64_t p50, p99, p999, max;
+};
+
+void print_row(const interval_row & r) {
+    std::cout << std::setw(7) << std::fixed << std::setprecision(1) << r.t
+              << std::setw(10) << r.sent << std::setw(10) << r.answered
+              << std::setw(8) << r.errors << std::setw(11) << std::setprecision(0) << r.rate
+              << std::setw(9) << r.p50 << std::setw(9) << r.p99
+              << std::setw(9) << r.p999 << std::setw(9) << r.max << std::endl;
+}
+
+// answers per second - logins happen before the load, and have their own time
+double throughput(int c, const command_stats & s, double secs, double login_secs) {
+    if ( c == login) return login_secs > 0 ? s.answered / login_secs : 0;
+    return s.answered / secs;
+}
+
+// writes the summary: one row per command, then "all" (the load, without logins)
+void write_csv(const std::string & file_name, command_stats * totals, double secs,
+               double login_secs) {
+    std::ofstream out(file_name.c_str());
+    out << "command,sent,answered,errors,throughput,mean_us,p50_us,p99_us,p999_us,max_us\n";
+    command_stats all;
+    for ( int c = 0; c <= command_count; ++c) {
+        const command_stats & s = c < command_count ? totals[c] : all;
+        if ( c < command_count && c != login) all.merge(totals[c]);
+        out << (c < command_count ? command_names[c] : "all") << ","
+            << s.sent << "," << s.answered << "," << s.errors << ","
+            << std::fixed << std::setprecision(1) << throughput(c, s, secs, login_secs) << ","
+            << s.latency.mean() << "," << s.latency.percentile(50) << ","
+            << s.latency.percentile(99) << "," << s.latency.percentile(99.9) << ","
+            << s.latency.max() << "\n";
+    }
+}
+
+void write_json(const std::string & file_name, command_stats * totals, double secs,
+                double login_secs, const std::vector<interval_row> & rows,
+                const std::string & config) {
+    std::ofstream out(file_name.c_str());
+    out << std::fixed << std::setprecision(1);
+    out << "{\n  \"config\": {" << config << "},\n  \"duration\": " << secs
+        << ",\n  \"commands\": {";
+    for ( int c = 0; c < command_count; ++c) {
+        const command_stats & s = totals[c];
+        out << (c ? "," : "") << "\n    \"" << command_names[c] << "\": {"
+            << "\"sent\": " << s.sent << ", \"answered\": " << s.answered
+            << ", \"errors\": " << s.errors << ", \"throughput\": " << throughput(c, s, secs, login_secs)
+            << ", \"mean_us\": " << s.latency.mean()
+            << ", \"p50_us\": " << s.latency.percentile(50)
+            << ", \"p99_us\": " << s.latency.percentile(99)
+            << ", \"p999_us\": " << s.latency.percentile(99.9)
+            << ", \"max_us\": " << s.latency.max() << "}";
+    }
+    out << "\n  },\n  \"intervals\": [";
+    for ( size_t i = 0; i < rows.size(); ++i) {
+        const interval_row & r = rows[i];
+        out << (i ? "," : "") << "\n    {\"t\": " << r.t << ", \"sent\": " << r.sent
+            << ", \"answered\": " << r.answered << ", \"errors\": " << r.errors
+            << ", \"throughput\": " << r.rate << ", \"p50_us\": " << r.p50
+            << ", \"p99_us\": " << r.p99 << ", \"p999_us\": " << r.p999
+            << ", \"max_us\": " << r.max << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void raise_fd_limit() {
+#ifdef __linux__
+    // every session is a socket
+    rlimit limit;
+    if ( getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+/** usage: load_generator [--host address] [--port port] [--sessions count]
+                          [--rate requests/s] [--depth count] [--duration secs]
+                          [--mix ping,ask_clients] [--threads count] [--connect-rate sessions/s]
+                          [--interval secs] [--csv file] [--json file]
+    - opens "sessions" sessions (default 1000) to the server (default
+      127.0.0.1:8001), at connect-rate per second (default 2000, 0 = all
+      at once); each one logs in
+    - then sends "rate" requests per second (default 1000) for "duration"
+      seconds (default 10), spread over all the sessions; "mix" is the
+      weight of pings vs ask_clients (default 90,10)
+    - --rate 0: as fast as the server answers, each session keeping "depth"
+      requests (default 1) pending
+    - every "interval" seconds (default 1), prints what happened in it;
+      at the end, the latency of each command (in microseconds)
+    - --csv / --json: also write the results there - the csv has the
+      summary, the json has the intervals as well
+    - "threads" loops (default 1) share the sessions
+    - note: the server disconnects sessions that don't ping for 5 secs;
+      quiet sessions ping on their own (those pings aren't measured)
+    - note: one address only has ~28000 ephemeral ports to connect from
+*/
+int main(int argc, char* argv[]) {
+    std::string host = "127.0.0.1", csv_file, json_file;
+    unsigned short port = 8001;
+    size_t session_count = 1000, thread_count = 1, depth = 1;
+    double rate = 1000, duration = 10, connect_rate = 2000, interval = 1;
+    std::vector<int> mix(2);
+    mix[0] = 90; mix[1] = 10;
+    for ( int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i], value = argv[i + 1];
+        if ( arg == "--host") host = value;
+        else if ( arg == "--port") port = (unsigned short)std::atoi(value.c_str());
+        else if ( arg == "--sessions") session_count = std::atoi(value.c_str());
+        else if ( arg == "--rate") rate = std::atof(value.c_str());
+        else if ( arg == "--depth") depth = std::atoi(value.c_str());
+        else if ( arg == "--duration") duration = std::atof(value.c_str());
+        else if ( arg == "--threads") thread_count = std::atoi(value.c_str());
+        else if ( arg == "--connect-rate") connect_rate = std::atof(value.c_str());
+        else if ( arg == "--interval") interval = std::atof(value.c_str());
+        else if ( arg == "--csv") csv_file = value;
+        else if ( arg == "--json") json_file = value;
+        else if ( arg == "--mix") {
+            mix[0] = std::atoi(value.c_str());
+            size_t comma = value.find(',');
+            mix[1] = comma != std::string::npos ? std::atoi(value.c_str() + comma + 1) : 0;
+        }
+        else { std::cerr << "unknown option " << arg << std::endl; return 1; }
+    }
+    if ( session_count == 0 || thread_count == 0 || depth == 0 || mix[0] + mix[1] <= 0
+            || interval <= 0) {
+        std::cerr << "invalid options" << std::endl;
+        return 1;
+    }
+    raise_fd_limit();
+    ip::tcp::endpoint ep( ip::address::from_string(host), port);
+
+    io_service_pool loops(thread_count, false);
+    std::vector< boost::shared_ptr<load_driver> > drivers;
+    for ( size_t i = 0; i < thread_count; ++i)
+        drivers.push_back( boost::shared_ptr<load_driver>(
+            new load_driver(loops.service(i), ep, connect_rate / thread_count, mix, depth)));
+    for ( size_t i = 0; i < session_count; ++i) {
+        std::ostringstream name;
+        name << "l" << i;
+        load_driver & driver = *drivers[i % thread_count];
+        driver.add( load_session::ptr(new load_session(
+            loops.service(i % thread_count), driver.stats(), name.str())));
+    }
+    loops.start();
+
+    // connect + log in everybody first
+    clock_type::time_point begin = clock_type::now();
+    for ( size_t i = 0; i < drivers.size(); ++i) drivers[i]->start();
+    size_t ready = 0, failed = 0;
+    for ( ;; ) {
+        boost::this_thread::sleep( boost::posix_time::millisec(10));
+        ready = failed = 0;
+        for ( size_t i = 0; i < drivers.size(); ++i) {
+            ready += drivers[i]->ready();
+            failed += drivers[i]->failed();
+        }
+        if ( ready + failed >= session_count
+                || clock_type::now() - begin > boost::chrono::seconds(60)) break;
+    }
+    double login_secs = to_micros(clock_type::now() - begin) / 1e6;
+    std::cout << ready << " sessions logged in, " << failed << " failed, in "
+              << std::fixed << std::setprecision(2) << login_secs << " secs" << std::endl;
+    if ( ready == 0) {
+        loops.stop();
+        return 1;
+    }
+
+    // the load
+    clock_type::time_point start = clock_type::now();
+    for ( size_t i = 0; i < drivers.size(); ++i)
+        drivers[i]->load(rate / thread_count, start);
+    std::cout << "   time      sent  answered  errors      req/s      p50      p99    p99.9      max"
+              << std::endl;
+    std::vector<interval_row> rows;
+    clock_type::time_point end = start + boost::chrono::microseconds( boost::uint64_t(duration * 1e6));
+    clock_type::time_point last = start;
+    while ( last < end) {
+        clock_type::time_point next = last + boost::chrono::microseconds( boost::uint64_t(interval * 1e6));
+        if ( next > end) next = end;
+        boost::this_thread::sleep_for(next - clock_type::now());
+        clock_type::time_point now = clock_type::now();
+        command_stats taken[command_count], all;
+        for ( size_t i = 0; i < drivers.size(); ++i)
+            drivers[i]->stats().take_interval(taken);
+        for ( int c = 0; c < command_count; ++c)
+            if ( c != login) all.merge(taken[c]);
+        interval_row row = { to_micros(now - start) / 1e6, all.sent, all.answered, all.errors,
+                             all.answered / (to_micros(now - last) / 1e6),
+                             all.latency.percentile(50), all.latency.percentile(99),
+                             all.latency.percentile(99.9), all.latency.max() };
+        print_row(row);
+        rows.push_back(row);
+        last = now;
+    }
+    for ( size_t i = 0; i < drivers.size(); ++i) drivers[i]->stop_load();
+    double secs = to_micros(clock_type::now() - start) / 1e6;
+    // the answers still on their way
+    boost::this_thread::sleep( boost::posix_time::millisec(500));
+    for ( size_t i = 0; i < drivers.size(); ++i) drivers[i]->stop();
+    boost::this_thread::sleep( boost::posix_time::millisec(100));
+    loops.stop();
+    loops.join();
+
+    command_stats totals[command_count];
+    for ( size_t i = 0; i < drivers.size(); ++i)
+        drivers[i]->stats().take_total(totals);
+    std::cout << "\ncommand           sent  answered  errors      req/s     mean      p50      p99    p99.9      max"
+              << std::endl;
+    for ( int c = 0; c < command_count; ++c) {
+        const command_stats & s = totals[c];
+        std::cout << std::left << std::setw(12) << command_names[c] << std::right
+                  << std::setw(11) << s.sent << std::setw(10) << s.answered
+                  << std::setw(8) << s.errors << std::setw(11) << std::setprecision(0)
+                  << throughput(c, s, secs, login_secs)
+                  << std::setw(9) << s.latency.mean()
+                  << std::setw(9) << s.latency.percentile(50) << std::setw(9) << s.latency.percentile(99)
+                  << std::setw(9) << s.latency.percentile(99.9) << std::setw(9) << s.latency.max()
+                  << std::endl;
+    }
+    std::ostringstream config;
+    config << "\"host\": \"" << host << "\", \"port\": " << port
+           << ", \"sessions\": " << session_count << ", \"rate\": " << rate
+           << ", \"depth\": " << depth
+           << ", \"duration\": " << duration << ", \"threads\": " << thread_count
+           << ", \"mix\": [" << mix[0] << ", " << mix[1] << "]";
+    if ( !csv_file.empty()) write_csv(csv_file, totals, secs, login_secs);
+    if ( !json_file.empty()) write_json(json_file, totals, secs, login_secs, rows, config.str());
+}
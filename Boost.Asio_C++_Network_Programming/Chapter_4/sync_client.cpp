@@ -9,8 +9,13 @@
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <cstring>
+#include "../common/line_buffer.hpp"
+#include "../common/binary_protocol.hpp"
 using namespace boost::asio;
 io_service service;
+// talk the binary protocol (--binary)
+bool use_binary = false;
 
 /** simple connection to server:
     - logs in just with username (no password)
@@ -23,13 +28,18 @@ io_service service;
 */
 struct talk_to_svr {
     talk_to_svr(const std::string & username) 
-        : sock_(service), started_(true), username_(username) {}
+        : sock_(service), buff_(max_msg), started_(true), username_(username)
+        , binary_(use_binary), bytes_written_(0), bytes_read_(0) {}
     void connect(ip::tcp::endpoint ep) {
         sock_.connect(ep);
     }
     void loop() {
         // read answer to our login
-        write("login " + username_ + "\n");
+        if ( binary_) 
+            write( std::string(1, char(binary_protocol::handshake))
+                 + binary_protocol::writer(binary_protocol::login).string(username_).frame());
+        else
+            write("login " + username_ + "\n");
         read_answer();
         while ( started_) {
             write_request();
@@ -41,23 +51,65 @@ struct talk_to_svr {
         }
     }
     std::string username() const { return username_; }
+    // so that we can compare the text and binary protocols
+    size_t bytes_written() const { return bytes_written_; }
+    size_t bytes_read() const { return bytes_read_; }
 private:
     void write_request() {
-        write("ping\n");
+        write(binary_ ? binary_protocol::frame(binary_protocol::ping) : "ping\n");
     }
     void read_answer() {
-        already_read_ = 0;
-        read(sock_, buffer(buff_), 
-             boost::bind(&talk_to_svr::read_complete, this, _1, _2));
-        process_msg();
+        if ( binary_) {
+            read_frame();
+            return;
+        }
+        std::string msg;
+        while ( !buff_.next_line(msg)) {
+            if ( buff_.overflow())
+                throw boost::system::system_error(error::message_size);
+            read_some();
+        }
+        process_msg(msg);
+    }
+    void read_frame() {
+        binary_protocol::frame_view f;
+        binary_protocol::frame_result result;
+        while ( (result = binary_protocol::next_frame(buff_, f)) != binary_protocol::frame_ok) {
+            if ( result == binary_protocol::frame_invalid)
+                throw boost::system::system_error(error::message_size);
+            read_some();
+        }
+        process_frame(f);
+    }
+    void read_some() {
+        size_t bytes = sock_.read_some(buff_.prepare());
+        buff_.commit(bytes);
+        bytes_read_ += bytes;
     }
-    void process_msg() {
-        std::string msg(buff_, already_read_);
+    void process_msg(const std::string & msg) {
         if ( msg.find("login ") == 0) on_login();
         else if ( msg.find("ping") == 0) on_ping(msg);
-        else if ( msg.find("clients ") == 0) on_clients(msg);
+        else if ( msg.find("clients ") == 0) on_clients(msg.substr(8));
         else std::cerr << "invalid msg " << msg << std::endl;
     }
+    void process_frame(const binary_protocol::frame_view & f) {
+        binary_protocol::reader in(f.data, f.size);
+        std::string clients;
+        const char * name;
+        size_t count = 0, len;
+        switch ( f.op) {
+        case binary_protocol::login_ok:     on_login(); break;
+        case binary_protocol::ping_ok:      break;
+        case binary_protocol::ping_changed: do_ask_clients(); break;
+        case binary_protocol::clients:
+            in.varint(count);
+            for ( ; count > 0 && in.string(name, len); --count)
+                clients.append(name, len) += " ";
+            on_clients(clients);
+            break;
+        default: std::cerr << "invalid msg, opcode " << int(f.op) << std::endl;
+        }
+    }
 
     void on_login() {
         std::cout << username_ << " logged in" << std::endl;
@@ -70,33 +122,26 @@ private:
         if ( answer == "client_list_changed") 
             do_ask_clients();
     }
-    void on_clients(const std::string & msg) {
-        std::string clients = msg.substr(8);
-        std::cout << username_ << ", new client list:" << clients;
+    void on_clients(const std::string & clients) {
+        std::cout << username_ << ", new client list:" << clients << std::endl;
     }
     void do_ask_clients() {
-        write("ask_clients\n");
+        write(binary_ ? binary_protocol::frame(binary_protocol::ask_clients) : "ask_clients\n");
         read_answer();
     }
 
     void write(const std::string & msg) {
-        sock_.write_some(buffer(msg));
-    }
-    size_t read_complete(const boost::system::error_code & err, size_t bytes) {
-        if ( err) return 0;
-        already_read_ = bytes;
-        bool found = std::find(buff_, buff_ + bytes, '\n') < buff_ + bytes;
-        // we read one-by-one until we get to enter, no buffering
-        return found ? 0 : 1;
+        bytes_written_ += sock_.write_some(buffer(msg));
     }
 
 private:
     ip::tcp::socket sock_;
     enum { max_msg = 1024 };
-    int already_read_;
-    char buff_[max_msg];
+    line_buffer buff_;
     bool started_;
     std::string username_;
+    bool binary_;
+    size_t bytes_written_, bytes_read_;
 };
 
 ip::tcp::endpoint ep( ip::address::from_string("127.0.0.1"), 8001);
@@ -107,11 +152,17 @@ void run_client(const std::string & client_name) {
         client.loop();
     } catch(boost::system::system_error & err) {
         std::cout << "client terminated " << client.username() 
-                  << ": " << err.what() << std::endl;
+                  << ": " << err.what() << " (sent " << client.bytes_written() 
+                  << " bytes, received " << client.bytes_read() << ")" << std::endl;
     }
 }
 
+/** usage: sync_client [--binary]
+    - --binary: talk the binary protocol (see binary_protocol.hpp)
+*/
 int main(int argc, char* argv[]) {
+    for ( int i = 1; i < argc; ++i)
+        if ( std::strcmp(argv[i], "--binary") == 0) use_binary = true;
     boost::thread_group threads;
     char* names[] = { "John", "James", "Lucy", "Tracy", "Frank", "Abby", 0 };
     for ( char ** name = names; *name; ++name) {
@@ -3,24 +3,41 @@
 #include <stdio.h>
 #endif
 
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
 
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include "../common/line_buffer.hpp"
+#include "../common/text_protocol.hpp"
+#include "../common/client_registry.hpp"
+#include "../common/client_list.hpp"
+#include "../common/timing_wheel.hpp"
+#include "../common/binary_protocol.hpp"
+#include "../common/server_stats.hpp"
+#include "../common/async_log.hpp"
 using namespace boost::asio;
 using namespace boost::posix_time;
 io_service service;
 
 struct talk_to_client;
 typedef boost::shared_ptr<talk_to_client> client_ptr;
-typedef std::vector<client_ptr> array;
-array clients;
-// thread-safe access to clients array
-boost::recursive_mutex cs;
-
-void update_clients_changed() ;
+// thread-safe: each shard has its own lock
+client_registry<talk_to_client> clients;
+// the usernames, with the answer to ask_clients built once per change
+client_list client_names;
+// clients that haven't pinged for 5 seconds (checked every 100 ms)
+typedef timing_wheel<talk_to_client> idle_wheel;
+void on_idle_clients(const std::vector<client_ptr> & idle);
+idle_wheel idle_clients(5000, 100, on_idle_clients);
 
 /** simple connection to server:
     - logs in just with username (no password)
@@ -30,132 +47,310 @@ void update_clients_changed() ;
     Possible requests:
     - gets a list of all connected clients
     - ping: the server answers either with "ping ok" or "ping client_list_changed"
+    - stats: the server's counters (see server_stats.hpp)
+
+    A client can talk the binary protocol instead (see binary_protocol.hpp),
+    by sending the handshake byte first.
 */
-struct talk_to_client : boost::enable_shared_from_this<talk_to_client> {
+struct talk_to_client : boost::enable_shared_from_this<talk_to_client>
+                      , registry_hook, idle_wheel::entry {
     talk_to_client() 
-        : sock_(service), started_(false), already_read_(0) {
-        last_ping = microsec_clock::local_time();
+        : sock_(service), buff_(max_msg)
+        , protocol_known_(false), binary_(false)
+        , clients_version_(client_names.version()), idle_(&idle_clients)
+        , epoll_fd_(-1) {
     }
     std::string username() const { return username_; }
 
+    // epoll mode: we're watched by that epoll, and timed out by that wheel
+    void start(idle_wheel & idle, int epoll_fd = -1) {
+        idle_ = &idle;
+        epoll_fd_ = epoll_fd;
+        idle_->arm(*this);
+    }
     void answer_to_client() {
         try {
-            read_request();
+            if ( sock_.available())
+                read_request();
             process_request();
         } catch ( boost::system::system_error&) {
             stop();
         }
-        if ( timed_out()) {
+    }
+    // epoll mode: we're only called when there's something to read
+    // (or the client is gone - then read_request throws)
+    void on_readable() {
+        try {
+            read_request();
+            process_request();
+        } catch ( boost::system::system_error&) {
             stop();
-            std::cout << "stopping " << username_ << " - no ping in time" << std::endl;
         }
     }
-    void set_clients_changed() { clients_changed_ = true; }
     ip::tcp::socket & sock() { return sock_; }
-    bool timed_out() const {
-        ptime now = microsec_clock::local_time();
-        long long ms = (now - last_ping).total_milliseconds();
-        return ms > 5000 ;
-    }
     void stop() {
         // close client connection
         boost::system::error_code err;
+#ifdef __linux__
+        if ( epoll_fd_ >= 0 && sock_.is_open())
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, sock_.native_handle(), 0);
+#endif
+        if ( sock_.is_open()) server_stats::count(server_stats::closed);
         sock_.close(err);
+        idle_->disarm(*this);
+        client_names.remove( connection_id());
+        clients.remove(*this);
     }
 private:
     void read_request() {
-        if ( sock_.available())
-            already_read_ += sock_.read_some(
-                buffer(buff_ + already_read_, max_msg - already_read_));
+        size_t bytes = sock_.read_some(buff_.prepare());
+        buff_.commit(bytes);
+        server_stats::count(server_stats::bytes_in, bytes);
     }
     void process_request() {
-        bool found_enter = std::find(buff_, buff_ + already_read_, '\n') 
-                          < buff_ + already_read_;
-        if ( !found_enter)
-            return; // message is not full
-        // process the msg
-        last_ping = microsec_clock::local_time();
-        size_t pos = std::find(buff_, buff_ + already_read_, '\n') - buff_;
-        std::string msg(buff_, pos);
-        std::copy(buff_ + already_read_, buff_ + max_msg, buff_);
-        already_read_ -= pos + 1;
-
-        if ( msg.find("login ") == 0) on_login(msg);
-        else if ( msg.find("ping") == 0) on_ping();
-        else if ( msg.find("ask_clients") == 0) on_clients();
-        else std::cerr << "invalid msg " << msg << std::endl;
+        if ( !protocol_known_ && buff_.size() > 0) {
+            // binary clients tell us with their very first byte
+            protocol_known_ = true;
+            binary_ = static_cast<unsigned char>(*buff_.data()) == binary_protocol::handshake;
+            if ( binary_) buff_.consume(1);
+        }
+        if ( binary_) process_frames();
+        else process_lines();
+    }
+    void process_lines() {
+        const char * line;
+        size_t len;
+        while ( buff_.next_line(line, len)) {
+            idle_->touch(*this);
+            text_protocol::string_ref args;
+            text_protocol::command command = text_protocol::parse( text_protocol::string_ref(line, len), args);
+            server_stats::count_command(command);
+            switch ( command) {
+            case text_protocol::login:              on_login(args); break;
+            case text_protocol::ping:               on_ping(); break;
+            case text_protocol::ask_clients:        on_clients(); break;
+            case text_protocol::ask_clients_since:  on_clients_since(args); break;
+            case text_protocol::stats:              on_stats(); break;
+            default: async_log::limited(async_log::warning, "invalid msg {}", async_log::text(line, len));
+            }
+        }
+        if ( buff_.overflow()) {
+            server_stats::count(server_stats::invalid);
+            throw boost::system::system_error(error::message_size);
+        }
+    }
+    void process_frames() {
+        binary_protocol::frame_view f;
+        binary_protocol::frame_result result;
+        while ( (result = binary_protocol::next_frame(buff_, f)) == binary_protocol::frame_ok) {
+            idle_->touch(*this);
+            binary_protocol::reader in(f.data, f.size);
+            const char * name;
+            size_t len, since;
+            server_stats::count_command( binary_protocol::to_command(f.op));
+            switch ( f.op) {
+            case binary_protocol::login:
+                if ( in.string(name, len)) login( std::string(name, len));
+                break;
+            case binary_protocol::ping:                 on_ping(); break;
+            case binary_protocol::ask_clients:          on_clients(); break;
+            case binary_protocol::ask_clients_since:
+                if ( in.varint(since)) clients_since(since);
+                break;
+            case binary_protocol::stats:                on_stats(); break;
+            default: async_log::limited(async_log::warning, "invalid msg, opcode {}", int(f.op));
+            }
+        }
+        if ( result == binary_protocol::frame_invalid) {
+            server_stats::count(server_stats::invalid);
+            throw boost::system::system_error(error::message_size);
+        }
     }
     
-    void on_login(const std::string & msg) {
-        std::istringstream in(msg);
-        in >> username_ >> username_;
-        std::cout << username_ << " logged in" << std::endl;
-        write("login ok\n");
-        update_clients_changed();
+    void on_login(text_protocol::string_ref args) {
+        text_protocol::string_ref name;
+        if ( text_protocol::next_word(args, name)) login( name.to_string());
+        else {
+            async_log::limited(async_log::warning, "invalid msg - login without a name");
+            server_stats::count(server_stats::invalid);
+        }
+    }
+    void login(const std::string & username) {
+        username_ = username;
+        async_log::log(async_log::info, "{} logged in", username_);
+        client_names.add( connection_id(), username_);
+        write(binary_ ? binary_protocol::frame(binary_protocol::login_ok) : "login ok\n");
     }
     void on_ping() {
-        write(clients_changed_ ? "ping client_list_changed\n" : "ping ok\n");
-        clients_changed_ = false;
+        // did anybody log in/out since our last ping?
+        size_t version = client_names.version();
+        bool changed = version != clients_version_;
+        clients_version_ = version;
+        if ( binary_) 
+            write( binary_protocol::frame(changed ? binary_protocol::ping_changed : binary_protocol::ping_ok));
+        else
+            write(changed ? "ping client_list_changed\n" : "ping ok\n");
     }
     void on_clients() {
-        std::string msg;
-        { boost::recursive_mutex::scoped_lock lk(cs);
-          for( array::const_iterator b = clients.begin(), e = clients.end() ; b != e; ++b)
-            msg += (*b)->username() + " ";
-        }
-        write("clients " + msg + "\n");
+        client_list::snapshot_ptr clients = client_names.current();
+        write(binary_ ? clients->binary : clients->answer);
+    }
+    void on_clients_since(text_protocol::string_ref args) {
+        text_protocol::string_ref word;
+        size_t since = 0;
+        if ( text_protocol::next_word(args, word)) text_protocol::to_number(word, since);
+        clients_since(since);
+    }
+    void clients_since(size_t since) {
+        std::string answer;
+        if ( client_names.delta(since, answer, binary_)) write(answer);
+        else if ( binary_) write(client_names.current()->binary_versioned);
+        else write(client_names.current()->versioned);
+    }
+    void on_stats() {
+        std::string stats = server_stats::collect().text();
+        if ( binary_) write( binary_protocol::writer(binary_protocol::stats_answer).string(stats).frame());
+        else write("stats " + stats + "\n");
     }
 
 
     void write(const std::string & msg) {
-        sock_.write_some(buffer(msg));
+        server_stats::count(server_stats::bytes_out, sock_.write_some(buffer(msg)));
     }
 private:
     ip::tcp::socket sock_;
     enum { max_msg = 1024 };
-    int already_read_;
-    char buff_[max_msg];
-    bool started_;
+    line_buffer buff_;
+    // text or binary protocol - decided by the client's first byte
+    bool protocol_known_, binary_;
     std::string username_;
-    bool clients_changed_;
-    ptime last_ping;
+    // client_names.version() as of our last ping
+    size_t clients_version_;
+    idle_wheel * idle_;
+    int epoll_fd_;
 };
 
-void update_clients_changed() {
-    boost::recursive_mutex::scoped_lock lk(cs);
-    for( array::iterator b = clients.begin(), e = clients.end(); b != e; ++b)
-        (*b)->set_clients_changed();
+void on_idle_clients(const std::vector<client_ptr> & idle) {
+    for ( std::vector<client_ptr>::const_iterator b = idle.begin(), e = idle.end(); b != e; ++b) {
+        async_log::log(async_log::info, "stopping {} - no ping in time", (*b)->username());
+        server_stats::count(server_stats::timed_out);
+        (*b)->stop();
+    }
 }
 
 
+#ifdef __linux__
+/** epoll mode: each worker waits (epoll_wait) on its own clients' sockets:
+    - it only visits the clients that have something to read, so when
+      nobody talks, it just sleeps
+    - its own wheel times out its clients, so a client is only ever
+      touched by its worker thread
+*/
+struct epoll_worker : boost::noncopyable {
+    epoll_worker() : fd_(epoll_create1(0)), idle_(5000, 100, on_idle_clients) {}
+    ~epoll_worker() { close(fd_); }
+
+    void add(const client_ptr & client) {
+        client->start(idle_, fd_);
+        epoll_event ev = epoll_event();
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = client.get();
+        epoll_ctl(fd_, EPOLL_CTL_ADD, client->sock().native_handle(), &ev);
+    }
+    void run() {
+        enum { max_events = 256 };
+        epoll_event events[max_events];
+        while ( true) {
+            // wake up at least once per wheel tick
+            int count = epoll_wait(fd_, events, max_events, 100);
+            for ( int i = 0; i < count; ++i) {
+                // keep it alive, in case it stops
+                client_ptr client = static_cast<talk_to_client*>(events[i].data.ptr)->shared_from_this();
+                client->on_readable();
+            }
+            idle_.tick();
+        }
+    }
+private:
+    int fd_;
+    idle_wheel idle_;
+};
+#else
+struct epoll_worker : boost::noncopyable {
+    void add(const client_ptr & client) {}
+    void run() {}
+};
+#endif
+std::vector< boost::shared_ptr<epoll_worker> > workers;
 
 void accept_thread() {
     ip::tcp::acceptor acceptor(service, ip::tcp::endpoint(ip::tcp::v4(), 8001));
+    size_t next_worker = 0;
     while ( true) {
         client_ptr new_( new talk_to_client);
         acceptor.accept(new_->sock());
-        
-        boost::recursive_mutex::scoped_lock lk(cs);
-        clients.push_back(new_);
+        server_stats::count(server_stats::accepted);
+        clients.add(new_);
+        if ( workers.empty())
+            new_->start(idle_clients);
+        else
+            workers[next_worker++ % workers.size()]->add(new_);
     }
 }
 
 void handle_clients_thread() {
     while ( true) {
         boost::this_thread::sleep( millisec(1));
-        boost::recursive_mutex::scoped_lock lk(cs);
-        for ( array::iterator b = clients.begin(), e = clients.end(); b != e; ++b) 
-            (*b)->answer_to_client();
-        // erase clients that timed out
-        clients.erase(std::remove_if(clients.begin(), clients.end(), 
-                   boost::bind(&talk_to_client::timed_out,_1)), clients.end());
+        clients.for_each( boost::bind(&talk_to_client::answer_to_client,_1));
+        // stops the clients that timed out
+        idle_clients.tick();
     }
 }
 
+/** usage: sync_server [--epoll [workers]] [--stats secs] [--log level]
+    - default: one thread checks every client, every millisecond
+    - --epoll (Linux only): clients are spread over "workers" threads
+      (by default, one per core); each only handles its clients that
+      have something to read
+    - --stats: print the counters every "secs" seconds (clients can ask
+      for them any time, with "stats")
+    - --log: the least important messages to print - debug, info (the
+      default), warning, error or off
+*/
 int main(int argc, char* argv[]) {
+    bool use_epoll = false;
+    size_t worker_count = boost::thread::hardware_concurrency();
+    int stats_secs = 0;
+    for ( int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ( arg == "--epoll") {
+            use_epoll = true;
+            if ( i + 1 < argc && isdigit(argv[i + 1][0]))
+                worker_count = atoi(argv[++i]);
+        }
+        else if ( arg == "--stats" && i + 1 < argc) stats_secs = atoi(argv[++i]);
+        else if ( arg == "--log" && i + 1 < argc) {
+            async_log::level l;
+            if ( async_log::parse_level(argv[++i], l)) async_log::set_level(l);
+        }
+    }
+    server_stats::dump_every(stats_secs);
+#ifndef __linux__
+    if ( use_epoll) {
+        std::cerr << "--epoll is only available on Linux" << std::endl;
+        use_epoll = false;
+    }
+#endif
+
     boost::thread_group threads;
+    if ( use_epoll) {
+        for ( size_t i = 0; i < std::max<size_t>(worker_count, 1); ++i) {
+            workers.push_back( boost::shared_ptr<epoll_worker>(new epoll_worker));
+            threads.create_thread( boost::bind(&epoll_worker::run, workers.back().get()));
+        }
+    } else
+        threads.create_thread(handle_clients_thread);
     threads.create_thread(accept_thread);
-    threads.create_thread(handle_clients_thread);
     threads.join_all();
 }
 
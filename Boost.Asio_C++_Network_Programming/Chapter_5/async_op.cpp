@@ -4,7 +4,25 @@
 #endif
 
 
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
 #include <string>
+#include <vector>
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#endif
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
@@ -13,80 +31,176 @@
 using namespace boost::asio;
 io_service service;
 
+/** a pool of worker threads, for blocking operations:
+    - a worker sleeps until there's something to do, and is woken up
+      as soon as something is posted
+    - the queue is a deque, so taking the next operation is O(1)
+    - stats() shows how many operations wait, and how long they waited/ran
+*/
+class op_pool : private boost::noncopyable {
+public:
+    typedef boost::function<void ()> task;
+    struct statistics {
+        size_t threads, queued, running, completed;
+        double avg_wait_ms, max_wait_ms, avg_run_ms, max_run_ms;
+    };
+
+    // thread_count = 0 means one thread per core
+    explicit op_pool(size_t thread_count = 0) 
+        : thread_count_(thread_count), stopping_(false), running_(0), completed_(0)
+        , total_wait_(0), max_wait_(0), total_run_(0), max_run_(0) {
+        if ( thread_count_ == 0) 
+            thread_count_ = std::max<size_t>(boost::thread::hardware_concurrency(), 1);
+    }
+    // waits for everything that's still queued
+    ~op_pool() {
+        { boost::mutex::scoped_lock lk(cs_);
+          stopping_ = true; }
+        not_empty_.notify_all();
+        threads_.join_all();
+    }
+    // only before the first post()
+    void set_size(size_t thread_count) {
+        boost::mutex::scoped_lock lk(cs_);
+        if ( thread_count > 0) thread_count_ = thread_count;
+    }
+    void post(task t) {
+        boost::mutex::scoped_lock lk(cs_);
+        if ( threads_.size() == 0)
+            for ( size_t i = 0; i < thread_count_; ++i)
+                threads_.create_thread( boost::bind(&op_pool::worker, this));
+        queue_.push_back( item(t));
+        lk.unlock();
+        not_empty_.notify_one();
+    }
+    statistics stats() const {
+        boost::mutex::scoped_lock lk(cs_);
+        statistics s;
+        s.threads = threads_.size();
+        s.queued = queue_.size();
+        s.running = running_;
+        s.completed = completed_;
+        s.avg_wait_ms = completed_ ? to_ms(total_wait_) / completed_ : 0;
+        s.max_wait_ms = to_ms(max_wait_);
+        s.avg_run_ms = completed_ ? to_ms(total_run_) / completed_ : 0;
+        s.max_run_ms = to_ms(max_run_);
+        return s;
+    }
+private:
+    typedef boost::chrono::steady_clock clock;
+    typedef boost::chrono::nanoseconds nanosec;
+    struct item {
+        item() {}
+        explicit item(task t) : t(t), queued_at(clock::now()) {}
+        task t;
+        clock::time_point queued_at;
+    };
+    static double to_ms(nanosec ns) { return ns.count() / 1000000.0; }
+
+    void worker() {
+        while ( true) {
+            item cur;
+            { boost::mutex::scoped_lock lk(cs_);
+              while ( queue_.empty() && !stopping_)
+                  not_empty_.wait(lk);
+              if ( queue_.empty()) 
+                  return; // stopping, and nothing left to do
+              cur = queue_.front();
+              queue_.pop_front();
+              ++running_;
+              nanosec wait = clock::now() - cur.queued_at;
+              total_wait_ += wait;
+              max_wait_ = std::max(max_wait_, wait);
+            }
+            clock::time_point start = clock::now();
+            cur.t();
+            nanosec run = clock::now() - start;
+            { boost::mutex::scoped_lock lk(cs_);
+              --running_;
+              ++completed_;
+              total_run_ += run;
+              max_run_ = std::max(max_run_, run);
+            }
+        }
+    }
+private:
+    mutable boost::mutex cs_;
+    boost::condition_variable not_empty_;
+    std::deque<item> queue_;
+    boost::thread_group threads_;
+    size_t thread_count_;
+    bool stopping_;
+    size_t running_, completed_;
+    nanosec total_wait_, max_wait_, total_run_, max_run_;
+};
+
+/** executes an operation on the worker pool (shared by all async_ops),
+    then posts its completion to the io_service you gave us. You can have 
+    as many operations in flight as you want.
+*/
 struct async_op : boost::enable_shared_from_this<async_op>
                , private boost::noncopyable {
     typedef boost::shared_ptr<async_op> ptr;
     static ptr new_() { return ptr(new async_op); }
+
+    typedef op_pool::statistics statistics;
+    static statistics stats() { return pool().stats(); }
+    // how many worker threads - call it before the first add()
+    static void set_pool_size(size_t thread_count) { pool().set_size(thread_count); }
 private:
     typedef boost::function<void(boost::system::error_code)> completion_func;
     typedef boost::function<boost::system::error_code ()> op_func;
-    async_op() : started_(false) {}
+    async_op() : generation_(0) {}
     struct operation {
-        operation(io_service & service, op_func op, completion_func completion)
-            : service(&service), op(op), completion(completion)
+        operation(ptr self, io_service & service, op_func op, completion_func completion)
+            : self(self), generation(self->generation_.load()), service(&service)
+            , op(op), completion(completion)
             , work(new io_service::work(service))
         {}
-        operation() : service(0) {}
+        // so that we're not destroyed while async-executing something
+        ptr self;
+        // a stop() since we were added drops us
+        size_t generation;
         io_service * service;
         op_func op;
         completion_func completion;
         typedef boost::shared_ptr<io_service::work> work_ptr;
         work_ptr work;
     };
-    typedef std::vector<operation> array;
-    void start() {
-        { boost::recursive_mutex::scoped_lock lk(cs_);
-          if ( started_)
-              return;
-        started_ = true; }
-        boost::thread t( boost::bind(&async_op::run,this));
+    static op_pool & pool() {
+        static op_pool p;
+        return p;
     }
-    void run() {
-        while ( true) {
-            { boost::recursive_mutex::scoped_lock lk(cs_);
-              if ( !started_) break; 
-            }
-            boost::this_thread::sleep( boost::posix_time::millisec(10));
-            operation cur;
-            { boost::recursive_mutex::scoped_lock lk(cs_);
-              if ( !ops_.empty()) {
-                  cur = ops_[0];
-                  ops_.erase( ops_.begin());
-              }}
-            if ( cur.service) {
-                boost::system::error_code err = cur.op();
-                cur.service->post(boost::bind(cur.completion, err));
-            }
-        }
-        self_.reset();
+    static void run(operation cur) {
+        if ( cur.generation != cur.self->generation_) return;
+        boost::system::error_code err = cur.op();
+        cur.service->post(boost::bind(cur.completion, err));
     }
 public:
     void add(op_func op, completion_func completion, io_service & service) {
-        // so that we're not destroyed while async-executing something
-        self_ = shared_from_this();
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        ops_.push_back( operation(service, op, completion));
-        if ( !started_) start();
+        pool().post( boost::bind(&async_op::run, 
+                        operation(shared_from_this(), service, op, completion)));
     }
+    // operations added so far that haven't started yet are dropped;
+    // the ones added afterwards run as usual
     void stop() {
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        started_ = false;
-        ops_.clear();
+        ++generation_;
     }
 private:
-    array ops_;
-    bool started_;
-    boost::recursive_mutex cs_;
-    ptr self_;
+    boost::atomic<size_t> generation_;
 };
 
-size_t checksum = 0;
-boost::system::error_code compute_file_checksum(std::string file_name) {
+// each computation has its own result
+typedef boost::shared_ptr<size_t> checksum_ptr;
+
+#ifdef WIN32
+boost::system::error_code compute_file_checksum(std::string file_name, checksum_ptr checksum,
+                                                size_t /* threads */ = 1) {
     HANDLE file = ::CreateFile(file_name.c_str(), GENERIC_READ, 0, 0, 
         OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0);
     windows::random_access_handle h(service, file);
     long buff[1024];
-    checksum = 0;
+    size_t sum = 0;
     size_t bytes = 0;
     size_t at = 0;
     boost::system::error_code ec;
@@ -94,18 +208,114 @@ boost::system::error_code compute_file_checksum(std::string file_name) {
         at += bytes;
         bytes /= sizeof(long);
         for ( size_t i = 0; i < bytes; ++i)
-            checksum += buff[i];
+            sum += buff[i];
     }
+    *checksum = sum;
     return boost::system::error_code(0, boost::system::generic_category());
 }
-void on_checksum(std::string file_name, boost::system::error_code) {
-    std::cout << "checksum for " << file_name << "=" << checksum << std::endl;
+#else
+// the sum of the longs in [begin, end). Adding wraps around, so the order
+// doesn't matter - we add 2 (SSE2) or 4 (AVX2) at a time, in two 
+// independent accumulators, so the adds don't wait for each other
+size_t sum_longs(const unsigned long * begin, const unsigned long * end) {
+    size_t sum = 0;
+#if defined(__AVX2__) && defined(__LP64__)
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    for ( ; end - begin >= 8; begin += 8) {
+        acc0 = _mm256_add_epi64(acc0, _mm256_loadu_si256((const __m256i*)begin));
+        acc1 = _mm256_add_epi64(acc1, _mm256_loadu_si256((const __m256i*)(begin + 4)));
+    }
+    unsigned long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(acc0, acc1));
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__) && defined(__LP64__)
+    __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+    for ( ; end - begin >= 4; begin += 4) {
+        acc0 = _mm_add_epi64(acc0, _mm_loadu_si128((const __m128i*)begin));
+        acc1 = _mm_add_epi64(acc1, _mm_loadu_si128((const __m128i*)(begin + 2)));
+    }
+    unsigned long lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc0, acc1));
+    sum = lanes[0] + lanes[1];
+#endif
+    for ( ; begin < end; ++begin)
+        sum += *begin;
+    return sum;
+}
+
+void sum_range(const unsigned long * begin, const unsigned long * end, size_t & sum) {
+    sum = sum_longs(begin, end);
+}
+
+/** maps the whole file (no copying into our buffers), and tells the kernel 
+    we'll read it front to back, so it reads ahead aggressively. 
+    With threads > 1, the file is split into that many pieces, summed in 
+    parallel, and the partial sums are added up.
+*/
+boost::system::error_code compute_file_checksum(std::string file_name, checksum_ptr checksum,
+                                                size_t threads = 1) {
+    using boost::system::error_code;
+    using boost::system::system_category;
+    *checksum = 0;
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if ( fd < 0) return error_code(errno, system_category());
+    struct stat info;
+    if ( ::fstat(fd, &info) < 0) {
+        error_code err(errno, system_category());
+        ::close(fd);
+        return err;
+    }
+    size_t size = info.st_size;
+    if ( size == 0) {
+        ::close(fd);
+        return error_code();
+    }
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    void * data = ::mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if ( data == MAP_FAILED) return error_code(errno, system_category());
+    ::madvise(data, size, MADV_SEQUENTIAL);
+
+    const unsigned long * begin = static_cast<const unsigned long*>(data);
+    const unsigned long * end = begin + size / sizeof(long);
+    size_t count = end - begin;
+    if ( threads < 1) threads = 1;
+    if ( threads > 1 && count / threads >= 1024 * 1024) {
+        std::vector<size_t> sums(threads);
+        boost::thread_group pieces;
+        size_t piece = count / threads;
+        for ( size_t i = 1; i < threads; ++i) 
+            pieces.create_thread( boost::bind(sum_range, begin + i * piece, 
+                i + 1 < threads ? begin + (i + 1) * piece : end, boost::ref(sums[i])));
+        sum_range(begin, begin + piece, sums[0]);
+        pieces.join_all();
+        size_t sum = 0;
+        for ( size_t i = 0; i < threads; ++i)
+            sum += sums[i];
+        *checksum = sum;
+    } else
+        *checksum = sum_longs(begin, end);
+    ::munmap(data, size);
+    return error_code();
+}
+#endif
+
+void on_checksum(std::string file_name, checksum_ptr checksum, boost::system::error_code err) {
+    if ( err) std::cout << "checksum for " << file_name << " failed: " << err.message() << std::endl;
+    else std::cout << "checksum for " << file_name << "=" << *checksum << std::endl;
 }
 
+// usage: async_op [file_name] [threads]
 int main(int argc, char* argv[]) {
-    std::string fn = "readme.txt";
-    async_op::new_()->add( boost::bind(compute_file_checksum,fn),
-                           boost::bind(on_checksum,fn,_1), service);
+    std::string fn = argc > 1 ? argv[1] : "readme.txt";
+    size_t threads = argc > 2 ? atoi(argv[2]) : 1;
+    checksum_ptr checksum(new size_t(0));
+    async_op::new_()->add( boost::bind(compute_file_checksum,fn,checksum,threads),
+                           boost::bind(on_checksum,fn,checksum,_1), service);
     service.run();
+    async_op::statistics stats = async_op::stats();
+    std::cout << "ops: " << stats.completed << " done, " << stats.queued << " queued; "
+              << "wait avg " << stats.avg_wait_ms << " ms, max " << stats.max_wait_ms << " ms; "
+              << "run avg " << stats.avg_run_ms << " ms, max " << stats.max_run_ms << " ms" << std::endl;
 }
 
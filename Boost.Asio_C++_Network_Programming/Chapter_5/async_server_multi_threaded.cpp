@@ -3,30 +3,62 @@
 #include <stdio.h>
 #endif
 
-
+#include <cctype>
+#include <cstdlib>
 
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include "../common/line_buffer.hpp"
+#include "../common/handler_allocator.hpp"
+#include "../common/text_protocol.hpp"
+#include "../common/write_queue.hpp"
+#include "../common/io_service_pool.hpp"
+#include "../common/client_registry.hpp"
+#include "../common/client_list.hpp"
+#include "../common/timing_wheel.hpp"
+#include "../common/object_pool.hpp"
+#include "../common/server_stats.hpp"
+#include "../common/async_log.hpp"
+#include "../common/request_trace.hpp"
 using namespace boost::asio;
 using namespace boost::posix_time;
 io_service service;
+// per-core mode: one io_service per core, each run by its own thread
+boost::scoped_ptr<io_service_pool> loops;
 
 class talk_to_client;
 typedef boost::shared_ptr<talk_to_client> client_ptr;
-typedef std::vector<client_ptr> array;
-array clients;
-boost::recursive_mutex clients_cs;
+// thread-safe: each shard has its own lock
+client_registry<talk_to_client> clients;
+// the usernames, with the answer to ask_clients built once per change
+client_list client_names;
+// logins and logouts are applied to client_names on this strand only, so
+// no handler waits for its writers' lock (its readers don't lock at all)
+boost::scoped_ptr<io_service::strand> names_owner;
+// clients that haven't pinged for 5 seconds (checked every 100 ms):
+// one wheel per loop in per-core mode, otherwise one for the shared service
+typedef timing_wheel<talk_to_client> idle_wheel;
+void on_idle_clients(const std::vector<client_ptr> & idle);
+std::vector< boost::shared_ptr<idle_wheel> > idle_clients;
+// talk_to_client objects are reused, not created for every accept:
+// one pool per loop, since a client's socket belongs to its loop
+typedef object_pool<talk_to_client> session_pool;
+std::vector< boost::shared_ptr<session_pool> > sessions;
 
 #define MEM_FN(x)       boost::bind(&self_type::x, shared_from_this())
 #define MEM_FN1(x,y)    boost::bind(&self_type::x, shared_from_this(),y)
 #define MEM_FN2(x,y,z)  boost::bind(&self_type::x, shared_from_this(),y,z)
+// same, but asio allocates the operation from our handler_allocator_, and
+// the handler runs on our strand_ (the strand's own operation is allocated
+// from handler_allocator_ too - wrap() forwards the allocation hooks)
+#define ALLOC_FN(x)       strand_.wrap( make_custom_alloc_handler(handler_allocator_, MEM_FN(x)))
+#define ALLOC_FN1(x,y)    strand_.wrap( make_custom_alloc_handler(handler_allocator_, MEM_FN1(x,y)))
+#define ALLOC_FN2(x,y,z)  strand_.wrap( make_custom_alloc_handler(handler_allocator_, MEM_FN2(x,y,z)))
 
 
-void update_clients_changed();
-
 /** simple connection to server:
     - logs in just with username (no password)
     - all connections are initiated by the client: client asks, server answers
@@ -35,97 +67,174 @@ void update_clients_changed();
     Possible client requests:
     - gets a list of all connected clients
     - ping: the server answers either with "ping ok" or "ping client_list_changed"
+    - stats: the server's counters (see server_stats.hpp)
+
+    Threads: all of a client's handlers run on its strand_, one at a time,
+    so its state needs no lock. Anybody else (the acceptor, the idle
+    wheel) only posts to that strand - see start() and time_out(). What
+    clients know about each other comes from client_names, whose answers
+    are immutable snapshots; logins and logouts are posted to names_owner,
+    so a client shows up in the list shortly after its "login ok".
 */
 class talk_to_client : public boost::enable_shared_from_this<talk_to_client>
-                     , boost::noncopyable {
+                     , public registry_hook
+                     , public idle_wheel::entry, boost::noncopyable {
     typedef talk_to_client self_type;
-    talk_to_client() : sock_(service), started_(false), 
-                       timer_(service), clients_changed_(false) {
+    talk_to_client(io_service & service, size_t loop) 
+                     : strand_(service), sock_(service), read_buffer_(max_msg), started_(false), 
+                       clients_version_(0), loop_(loop), traced_requests_(0) {
     }
 public:
     typedef boost::system::error_code error_code;
     typedef boost::shared_ptr<talk_to_client> ptr;
+    typedef server_stats::value_type value_type;
 
     void start() {
-        { boost::recursive_mutex::scoped_lock lk(clients_cs);
-        clients.push_back( shared_from_this());
-        }
-        boost::recursive_mutex::scoped_lock lk(cs_);
+        strand_.dispatch( MEM_FN(on_start));
+    }
+    // no ping in time - called by the idle wheel
+    void time_out() {
+        strand_.dispatch( MEM_FN(on_time_out));
+    }
+    static ptr new_(size_t loop = 0) {
+        return sessions[loop]->acquire();
+    }
+    static talk_to_client * create(io_service & service, size_t loop) {
+        return new talk_to_client(service, loop);
+    }
+    // the pool calls this once nobody uses us anymore, before reusing us
+    void reset() {
+        error_code err;
+        sock_.close(err);
+        read_buffer_.clear();
+        server_stats::count(server_stats::queued_bytes, -value_type(write_queue_.bytes()));
+        write_queue_.clear();
+        started_ = false;
+        username_.clear();
+        clients_version_ = 0;
+        traced_requests_ = 0;
+    }
+    // before start() only - afterwards, the socket belongs to our strand
+    ip::tcp::socket & sock() { return sock_; }
+    // the accept failed, we'll never start - give back our loop
+    void abandon() {
+        if ( loops) loops->release(loop_);
+    }
+private:
+    void on_start() {
+        server_stats::count(server_stats::accepted);
+        clients.add( shared_from_this());
         started_ = true;
-        last_ping_ = boost::posix_time::microsec_clock::local_time();
+        clients_version_ = client_names.version();
+        idle().arm(*this);
         // first, we wait for client to login
         do_read();
     }
-    static ptr new_() {
-        ptr new_(new talk_to_client);
-        return new_;
+    void on_time_out() {
+        if ( !started_) return;
+        async_log::log(async_log::info, "stopping {} - no ping in time", username_);
+        server_stats::count(server_stats::timed_out);
+        stop();
     }
     void stop() {
-        { boost::recursive_mutex::scoped_lock lk(cs_);
         if ( !started_) return;
         started_ = false;
         sock_.close();
-        }
+        server_stats::count(server_stats::closed);
+        idle().disarm(*this);
 
         ptr self = shared_from_this();
-        { boost::recursive_mutex::scoped_lock lk(clients_cs);
-        array::iterator it = std::find(clients.begin(), clients.end(), self);
-        clients.erase(it);
-        }
-        update_clients_changed();
-    }
-    bool started() const { 
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        return started_; 
-    }
-    ip::tcp::socket & sock() { 
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        return sock_;
-    }
-    std::string username() const { 
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        return username_; 
-    }
-    void set_clients_changed() { 
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        clients_changed_ = true; 
+        clients.remove(self);
+        names_owner->post( boost::bind(&client_list::remove, &client_names, connection_id()));
+        if ( loops) loops->release(loop_);
     }
-private:
+    bool started() const { return started_; }
+
     void on_read(const error_code & err, size_t bytes) {
+        // --trace: timestamps at each stage (see request_trace.hpp)
+        bool trace = request_trace::enabled();
+        if ( trace) trace_.read = request_trace::now();
         if ( err) stop();
         if ( !started() ) return;
 
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        // process the msg
-        std::string msg(read_buffer_, bytes);
-        if ( msg.find("login ") == 0) on_login(msg);
-        else if ( msg.find("ping") == 0) on_ping();
-        else if ( msg.find("ask_clients") == 0) on_clients();
-        else std::cerr << "invalid msg " << msg << std::endl;
+        read_buffer_.commit(bytes);
+        server_stats::count(server_stats::bytes_in, bytes);
+        // process every msg we already have - the answers go out in one write
+        const char * line;
+        size_t len, count = 0;
+        while ( read_buffer_.next_line(line, len)) {
+            ++count;
+            idle().touch(*this);
+            text_protocol::string_ref args;
+            text_protocol::command command = text_protocol::parse( text_protocol::string_ref(line, len), args);
+            server_stats::count_command(command);
+            switch ( command) {
+            case text_protocol::login:              on_login(args); break;
+            case text_protocol::ping:               on_ping(); break;
+            case text_protocol::ask_clients:        on_clients(); break;
+            case text_protocol::ask_clients_since:  on_clients_since(args); break;
+            case text_protocol::stats:              on_stats(); break;
+            default: async_log::limited(async_log::warning, "invalid msg {}", async_log::text(line, len));
+            }
+        }
+        if ( read_buffer_.overflow()) {
+            async_log::limited(async_log::warning, "invalid msg - too long");
+            server_stats::count(server_stats::invalid);
+            stop();
+            return;
+        }
+        if ( trace && count > 0) {
+            trace_.handled = request_trace::now();
+            traced_requests_ = count;
+        }
+        if ( !started() ) return;
+        if ( write_queue_.pending()) flush_write();
+        else {
+            // nothing to answer - or the message is not full yet
+            end_trace( trace_.handled);
+            do_read();
+        }
+    }
+    // the request being traced is done
+    void end_trace(request_trace::clock_type::time_point written) {
+        if ( traced_requests_ == 0) return;
+        trace_.written = written;
+        request_trace::tracer::instance().add(trace_, connection_id(), traced_requests_);
+        traced_requests_ = 0;
     }
     
-    void on_login(const std::string & msg) {
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        std::istringstream in(msg);
-        in >> username_ >> username_;
-        std::cout << username_ << " logged in" << std::endl;
+    void on_login(text_protocol::string_ref args) {
+        text_protocol::string_ref name;
+        if ( !text_protocol::next_word(args, name)) {
+            async_log::limited(async_log::warning, "invalid msg - login without a name");
+            server_stats::count(server_stats::invalid);
+            return;
+        }
+        username_ = name.to_string();
+        async_log::log(async_log::info, "{} logged in", username_);
+        names_owner->post( boost::bind(&client_list::add, &client_names, connection_id(), username_));
         do_write("login ok\n");
-        update_clients_changed();
     }
     void on_ping() {
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        do_write(clients_changed_ ? "ping client_list_changed\n" : "ping ok\n");
-        clients_changed_ = false;
+        // did anybody log in/out since our last ping?
+        size_t version = client_names.version();
+        bool changed = version != clients_version_;
+        clients_version_ = version;
+        do_write(changed ? "ping client_list_changed\n" : "ping ok\n");
     }
     void on_clients() {
-        array copy;
-        { boost::recursive_mutex::scoped_lock lk(clients_cs);
-          copy = clients;
-        }
-        std::string msg;
-        for( array::const_iterator b = copy.begin(), e = copy.end() ; b != e; ++b)
-            msg += (*b)->username() + " ";
-        do_write("clients " + msg + "\n");
+        do_write(client_names.current()->answer);
+    }
+    void on_clients_since(text_protocol::string_ref args) {
+        text_protocol::string_ref word;
+        size_t since = 0;
+        if ( text_protocol::next_word(args, word)) text_protocol::to_number(word, since);
+        std::string answer;
+        if ( client_names.delta(since, answer)) do_write(answer);
+        else do_write(client_names.current()->versioned);
+    }
+    void on_stats() {
+        do_write("stats " + server_stats::collect().text() + "\n");
     }
 
     void do_ping() {
@@ -135,73 +244,167 @@ private:
         do_write("ask_clients\n");
     }
 
-    void on_check_ping() {
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
-        if ( (now - last_ping_).total_milliseconds() > 5000) {
-            std::cout << "stopping " << username_ << " - no ping in time" << std::endl;
-            stop();
-        }
-        last_ping_ = boost::posix_time::microsec_clock::local_time();
-    }
-    void post_check_ping() {
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        timer_.expires_from_now(boost::posix_time::millisec(5000));
-        timer_.async_wait( MEM_FN(on_check_ping));
-    }
+    // the wheel of the loop we live on
+    idle_wheel & idle() { return *idle_clients[loop_]; }
 
 
     void on_write(const error_code & err, size_t bytes) {
-        do_read();
+        server_stats::count(server_stats::bytes_out, bytes);
+        if ( traced_requests_ > 0) end_trace( request_trace::now());
+        size_t queued = write_queue_.bytes();
+        write_queue_.end_write();
+        server_stats::count(server_stats::queued_bytes, value_type(write_queue_.bytes()) - value_type(queued));
+        if ( err) stop();
+        else if ( write_queue_.pending()) flush_write();
+        else do_read();
     }
     void do_read() {
-        async_read(sock_, buffer(read_buffer_), 
-                   MEM_FN2(read_complete,_1,_2), MEM_FN2(on_read,_1,_2));
-        post_check_ping();
+        sock_.async_read_some(read_buffer_.prepare(), ALLOC_FN2(on_read,_1,_2));
     }
     void do_write(const std::string & msg) {
         if ( !started() ) return;
-        boost::recursive_mutex::scoped_lock lk(cs_);
-        std::copy(msg.begin(), msg.end(), write_buffer_);
-        sock_.async_write_some( buffer(write_buffer_, msg.size()), 
-                                MEM_FN2(on_write,_1,_2));
+        // sent by flush_write(), once all buffered requests are answered
+        if ( !write_queue_.push(msg)) {
+            async_log::limited(async_log::warning, "{} doesn't read its answers", username_);
+            stop();
+            return;
+        }
+        server_stats::count(server_stats::queued_bytes, msg.size());
+        server_stats::queue_depth(write_queue_.bytes());
     }
-    size_t read_complete(const boost::system::error_code & err, size_t bytes) {
-        if ( err) return 0;
-        bool found = std::find(read_buffer_, read_buffer_ + bytes, '\n') < read_buffer_ + bytes;
-        // we read one-by-one until we get to enter, no buffering
-        return found ? 0 : 1;
+    void flush_write() {
+        if ( !started() || write_queue_.writing() || !write_queue_.pending()) return;
+        async_write(sock_, write_queue_.start_write(), ALLOC_FN2(on_write,_1,_2));
     }
 private:
-    mutable boost::recursive_mutex cs_;
+    // runs our handlers - see ALLOC_FN
+    io_service::strand strand_;
+    // must outlive sock_ - closing it frees the pending operations
+    handler_allocator handler_allocator_;
     ip::tcp::socket sock_;
     enum { max_msg = 1024 };
-    char read_buffer_[max_msg];
-    char write_buffer_[max_msg];
+    line_buffer read_buffer_;
+    write_queue write_queue_;
     bool started_;
     std::string username_;
-    deadline_timer timer_;
-    boost::posix_time::ptime last_ping_;
-    bool clients_changed_;
+    // client_names.version() as of our last ping
+    size_t clients_version_;
+    // our io_service in per-core mode (index in loops)
+    size_t loop_;
+    // --trace: the stages of the request we're answering, and how many
+    // messages it had (0 = not traced)
+    request_trace::timestamps trace_;
+    size_t traced_requests_;
 };
 
-void update_clients_changed() {
-    array copy;
-    { boost::recursive_mutex::scoped_lock lk(clients_cs);
-      copy = clients;
+void on_idle_clients(const std::vector<client_ptr> & idle) {
+    for ( std::vector<client_ptr>::const_iterator b = idle.begin(), e = idle.end(); b != e; ++b) {
+        (*b)->time_out();
     }
-    for( array::iterator b = copy.begin(), e = copy.end(); b != e; ++b)
-        (*b)->set_clients_changed();
 }
 
-ip::tcp::acceptor acceptor(service, ip::tcp::endpoint(ip::tcp::v4(), 8001));
+void start_idle_clients() {
+    size_t count = loops ? loops->size() : 1;
+    for ( size_t i = 0; i < count; ++i) {
+        boost::shared_ptr<idle_wheel> wheel( new idle_wheel(5000, 100, on_idle_clients));
+        wheel->start( loops ? loops->service(i) : service);
+        idle_clients.push_back(wheel);
+    }
+}
 
-void handle_accept(talk_to_client::ptr client, const boost::system::error_code & err) {
-    client->start();
-    talk_to_client::ptr new_client = talk_to_client::new_();
-    acceptor.async_accept(new_client->sock(), boost::bind(handle_accept,new_client,_1));
+// in per-core mode, each new client lives on one of the loops
+talk_to_client::ptr new_client() {
+    if ( !loops) return talk_to_client::new_();
+    return talk_to_client::new_( loops->acquire());
 }
 
+void start_sessions(size_t warm_up, size_t grow_by) {
+    size_t count = loops ? loops->size() : 1;
+    for ( size_t i = 0; i < count; ++i) {
+        io_service & svc = loops ? loops->service(i) : service;
+        sessions.push_back( boost::shared_ptr<session_pool>( new session_pool(
+            boost::bind(talk_to_client::create, boost::ref(svc), i), warm_up / count, grow_by)));
+    }
+}
+
+/** accepts on port 8001, with several accepts outstanding - so that in
+    a burst of connects, the next one is picked up while we're still
+    starting the previous client
+    - normally, there's one acceptor on the global service, and new
+      clients are handed to the loops
+    - with --reuseport, each loop has its own acceptor (SO_REUSEPORT), and
+      the kernel spreads new connections between them; a client stays on
+      the loop that accepted it
+    - when we run out of descriptors (or memory), an accept would fail
+      again right away - that accept waits retry_ms before trying again
+*/
+class accept_loop : boost::noncopyable {
+public:
+    // loop = the loop we accept for, or -1 = hand clients to any loop
+    accept_loop(io_service & service, int loop, bool reuse_port)
+            : service_(service), acceptor_(service), strand_(service), loop_(loop) {
+        ip::tcp::endpoint ep(ip::tcp::v4(), 8001);
+        acceptor_.open(ep.protocol());
+        acceptor_.set_option(ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        typedef detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+        if ( reuse_port) acceptor_.set_option(reuse_port_option(true));
+#else
+        if ( reuse_port) std::cerr << "SO_REUSEPORT is not supported here" << std::endl;
+#endif
+        acceptor_.bind(ep);
+        acceptor_.listen(socket_base::max_connections);
+    }
+    void start(size_t outstanding) {
+        for ( size_t i = 0; i < outstanding; ++i)
+            strand_.post( boost::bind(&accept_loop::do_accept,this));
+    }
+private:
+    void do_accept() {
+        talk_to_client::ptr client;
+        if ( loop_ < 0) client = new_client();
+        else {
+            loops->acquire_on(loop_);
+            client = talk_to_client::new_(loop_);
+        }
+        // the acceptor is shared by all our handlers - they go through the strand
+        acceptor_.async_accept(client->sock(), 
+            strand_.wrap( boost::bind(&accept_loop::on_accept,this,client,_1)));
+    }
+    void on_accept(talk_to_client::ptr client, const boost::system::error_code & err) {
+        if ( err) {
+            client->abandon();
+            if ( err == error::operation_aborted) return;
+            async_log::limited(async_log::error, "accept failed: {}", err.message());
+            if ( out_of_resources(err)) retry_later();
+            else do_accept();
+            return;
+        }
+        client->start();
+        do_accept();
+    }
+    static bool out_of_resources(const boost::system::error_code & err) {
+        return err == error::no_descriptors || err == error::no_buffer_space || err == error::no_memory
+            || err == boost::system::errc::too_many_files_open_in_system;
+    }
+    // each failed accept has its own timer - the others keep going
+    void retry_later() {
+        boost::shared_ptr<deadline_timer> timer( new deadline_timer(service_));
+        timer->expires_from_now( millisec(int(retry_ms)));
+        timer->async_wait( strand_.wrap( boost::bind(&accept_loop::on_retry,this,timer)));
+    }
+    void on_retry(boost::shared_ptr<deadline_timer>) {
+        do_accept();
+    }
+private:
+    enum { retry_ms = 100 };
+    io_service & service_;
+    ip::tcp::acceptor acceptor_;
+    io_service::strand strand_;
+    int loop_;
+};
+std::vector< boost::shared_ptr<accept_loop> > acceptors;
+
 boost::thread_group threads;
 void listen_thread() {
     service.run();
@@ -212,9 +415,102 @@ void start_listen(int thread_count) {
         threads.create_thread( listen_thread);
 }
 
+// one io_service per core: the global service only accepts (on one thread),
+// each client is handled by the thread that owns its loop
+void start_per_core(size_t loop_count, bool pin, io_service_pool::policy_type policy) {
+    loops.reset( new io_service_pool(loop_count, pin, policy));
+    loops->start();
+}
+
+// --trace: SIGUSR1 prints where the time of the requests went
+boost::scoped_ptr<signal_set> trace_signal;
+void on_trace_signal(const boost::system::error_code & err, int) {
+    if ( err) return;
+    request_trace::tracer::instance().dump(std::cout);
+    trace_signal->async_wait(on_trace_signal);
+}
+void start_trace(io_service & svc, size_t slow_millis) {
+    request_trace::tracer::instance().enable(slow_millis * 1000);
+    trace_signal.reset( new signal_set(svc, SIGUSR1));
+    trace_signal->async_wait(on_trace_signal);
+}
+
+/** usage: async_server_multi_threaded [--per-core [loops]] [--no-pin] [--least-loaded]
+                                       [--reuseport] [--accepts count]
+                                       [--warm-up count] [--grow-by count] [--stats secs]
+                                       [--trace [slow_millis]] [--log level]
+    - default: 100 threads share one io_service
+    - --per-core: one io_service + thread per core (or per "loops"),
+      pinned to its CPU unless --no-pin
+    - new clients are given to the loops round-robin, or with --least-loaded
+      to the loop with the fewest clients
+    - --reuseport: per-core mode, where each loop accepts its own clients
+      (see accept_loop)
+    - each acceptor keeps "accepts" accepts outstanding (default 4)
+    - we create "warm-up" clients up front (default 256, split between
+      the loops), and when a loop runs out, "grow-by" more at once (default 64)
+    - --stats: print the counters every "secs" seconds (clients can ask
+      for them any time, with "stats")
+    - --trace: time the stages of every request (handling it, writing
+      the answer); on SIGUSR1, print their percentiles
+      and the last requests that took more than "slow_millis" (default 10)
+    - --log: the least important messages to print - debug, info (the
+      default), warning, error or off
+*/
 int main(int argc, char* argv[]) {
-    talk_to_client::ptr client = talk_to_client::new_();
-    acceptor.async_accept(client->sock(), boost::bind(handle_accept,client,_1));
-    start_listen(100);
+    bool per_core = false, pin = true;
+    size_t loop_count = 0;
+    io_service_pool::policy_type policy = io_service_pool::round_robin;
+    size_t warm_up = 256, grow_by = 64;
+    bool reuse_port = false;
+    size_t accepts = 4;
+    int stats_secs = 0;
+    bool trace = false;
+    size_t slow_millis = 10;
+    for ( int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ( arg == "--per-core") {
+            per_core = true;
+            if ( i + 1 < argc && isdigit(argv[i + 1][0]))
+                loop_count = atoi(argv[++i]);
+        }
+        else if ( arg == "--no-pin") pin = false;
+        else if ( arg == "--least-loaded") policy = io_service_pool::least_loaded;
+        else if ( arg == "--reuseport") per_core = reuse_port = true;
+        else if ( arg == "--accepts" && i + 1 < argc) accepts = atoi(argv[++i]);
+        else if ( arg == "--warm-up" && i + 1 < argc) warm_up = atoi(argv[++i]);
+        else if ( arg == "--grow-by" && i + 1 < argc) grow_by = atoi(argv[++i]);
+        else if ( arg == "--stats" && i + 1 < argc) stats_secs = atoi(argv[++i]);
+        else if ( arg == "--log" && i + 1 < argc) {
+            async_log::level l;
+            if ( async_log::parse_level(argv[++i], l)) async_log::set_level(l);
+        }
+        else if ( arg == "--trace") {
+            trace = true;
+            if ( i + 1 < argc && isdigit(argv[i + 1][0]))
+                slow_millis = atoi(argv[++i]);
+        }
+    }
+    server_stats::dump_every(stats_secs);
+
+    if ( per_core) start_per_core(loop_count, pin, policy);
+    // in reuseport mode, the global service isn't run
+    if ( trace) start_trace(reuse_port ? loops->service(0) : service, slow_millis);
+    names_owner.reset( new io_service::strand(reuse_port ? loops->service(0) : service));
+    start_idle_clients();
+    start_sessions(warm_up, grow_by);
+    if ( reuse_port) {
+        // the loops accept by themselves; the global service isn't used
+        for ( size_t i = 0; i < loops->size(); ++i)
+            acceptors.push_back( boost::shared_ptr<accept_loop>(
+                new accept_loop(loops->service(i), i, true)));
+        for ( size_t i = 0; i < acceptors.size(); ++i)
+            acceptors[i]->start(accepts);
+        loops->join();
+        return 0;
+    }
+    acceptors.push_back( boost::shared_ptr<accept_loop>( new accept_loop(service, -1, false)));
+    acceptors[0]->start(accepts);
+    start_listen(per_core ? 1 : 100);
     threads.join_all();
 }
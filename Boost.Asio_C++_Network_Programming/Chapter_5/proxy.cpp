@@ -3,15 +3,188 @@
 #include <stdio.h>
 #endif
 
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include "../common/ring_buffer.hpp"
 using namespace boost::asio;
 io_service service;
 using boost::ref;
+// Linux: forward with splice(), see proxy::start_splice()
+bool use_splice = false;
+
+/** the servers we forward to, in the listening mode (--listen):
+    - each server has a few connections opened in advance (--pool), so
+      a new client doesn't wait for a connect round trip
+    - every second we check that the idle connections are still alive,
+      open new ones to refill the pool, and mark a server unhealthy when
+      we can't connect to it (it gets healthy again once we can)
+    - a new client goes to the healthy server with the fewest active
+      clients, or with --hash, to the same server every time for the same
+      address (consistent hashing - adding or removing a server only moves
+      the clients of that server)
+    - kill -USR1 <pid> prints the stats of each server
+*/
+typedef boost::shared_ptr<ip::tcp::socket> socket_ptr;
+struct upstream {
+    upstream(const ip::tcp::endpoint & ep) 
+        : ep(ep), healthy(true), active(0), served(0), connecting(0)
+        , connects(0), failed(0), connect_us(0), max_connect_us(0) {}
+    ip::tcp::endpoint ep;
+    bool healthy;
+    size_t active;                  // clients being forwarded right now
+    size_t served;
+    std::deque<socket_ptr> idle;    // connected, waiting for a client
+    size_t connecting;              // pool connects in progress
+    // connect latency
+    size_t connects, failed;
+    boost::uint64_t connect_us, max_connect_us;
+};
+
+class balancer : boost::noncopyable {
+public:
+    typedef boost::system::error_code error_code;
+    typedef boost::chrono::steady_clock clock;
+
+    balancer() : pool_size_(4), hash_(false), timer_(service) {}
+    void add(const ip::tcp::endpoint & ep) {
+        upstreams_.push_back( boost::shared_ptr<upstream>(new upstream(ep)));
+        size_t idx = upstreams_.size() - 1;
+        for ( int i = 0; i < virtual_nodes; ++i) {
+            std::ostringstream key;
+            key << ep << "#" << i;
+            ring_[hash(key.str())] = idx;
+        }
+    }
+    bool empty() const { return upstreams_.empty(); }
+    void start(size_t pool_size, bool consistent_hash) {
+        pool_size_ = pool_size;
+        hash_ = consistent_hash;
+        check();
+    }
+
+    upstream & choose(const ip::address & client) {
+        if ( hash_) {
+            std::map<boost::uint32_t,size_t>::const_iterator at = ring_.lower_bound(hash(client.to_string()));
+            for ( size_t i = 0; i < ring_.size(); ++i, ++at) {
+                if ( at == ring_.end()) at = ring_.begin();
+                if ( upstreams_[at->second]->healthy) return *upstreams_[at->second];
+            }
+            return *upstreams_[0];
+        }
+        upstream * best = 0;
+        for ( size_t i = 0; i < upstreams_.size(); ++i) {
+            upstream & u = *upstreams_[i];
+            if ( !u.healthy) continue;
+            if ( !best || u.active < best->active) best = &u;
+        }
+        return best ? *best : *upstreams_[0];
+    }
+    // a connection from the pool, or an empty ptr - then connect yourself
+    socket_ptr take(upstream & u) {
+        socket_ptr sock;
+        while ( !u.idle.empty() && !sock) {
+            if ( alive(*u.idle.front())) sock = u.idle.front();
+            u.idle.pop_front();
+        }
+        refill(u);
+        return sock;
+    }
+    void on_connected(upstream & u, clock::time_point start, const error_code & err) {
+        if ( err) {
+            ++u.failed;
+            u.healthy = false;
+            return;
+        }
+        boost::uint64_t us = boost::chrono::duration_cast<boost::chrono::microseconds>(clock::now() - start).count();
+        u.healthy = true;
+        ++u.connects;
+        u.connect_us += us;
+        if ( us > u.max_connect_us) u.max_connect_us = us;
+    }
+    void dump_stats() const {
+        for ( size_t i = 0; i < upstreams_.size(); ++i) {
+            const upstream & u = *upstreams_[i];
+            std::cout << u.ep << (u.healthy ? " up" : " DOWN") 
+                      << " active " << u.active << " served " << u.served 
+                      << " pooled " << u.idle.size()
+                      << " connects " << u.connects << " failed " << u.failed
+                      << " connect avg " << (u.connects ? u.connect_us / u.connects : 0) 
+                      << "us max " << u.max_connect_us << "us" << std::endl;
+        }
+    }
+private:
+    void check() {
+        for ( size_t i = 0; i < upstreams_.size(); ++i) {
+            upstream & u = *upstreams_[i];
+            std::deque<socket_ptr> alive_ones;
+            for ( size_t j = 0; j < u.idle.size(); ++j)
+                if ( alive(*u.idle[j])) alive_ones.push_back(u.idle[j]);
+            u.idle.swap(alive_ones);
+            // an unhealthy server gets probed with a single connect
+            if ( u.healthy || u.connecting == 0) refill(u);
+        }
+        timer_.expires_from_now(boost::posix_time::seconds(1));
+        timer_.async_wait( boost::bind(&balancer::check, this));
+    }
+    void refill(upstream & u) {
+        size_t wanted = u.healthy ? pool_size_ : 1;
+        while ( u.idle.size() + u.connecting < wanted) {
+            socket_ptr sock(new ip::tcp::socket(service));
+            ++u.connecting;
+            sock->async_connect(u.ep, boost::bind(&balancer::on_pool_connect, this, 
+                                boost::ref(u), sock, clock::now(), _1));
+        }
+    }
+    void on_pool_connect(upstream & u, socket_ptr sock, clock::time_point start, const error_code & err) {
+        --u.connecting;
+        on_connected(u, start, err);
+        if ( err) return;
+        sock->non_blocking(true); // for the alive() check
+        u.idle.push_back(sock);
+        refill(u);
+    }
+    // the server didn't close the connection (and didn't send us anything)
+    static bool alive(ip::tcp::socket & sock) {
+        char c;
+        error_code err;
+        sock.receive(buffer(&c, 1), socket_base::message_peek, err);
+        return err == error::would_block;
+    }
+    static boost::uint32_t hash(const std::string & key) {
+        // FNV-1a
+        boost::uint32_t h = 2166136261u;
+        for ( size_t i = 0; i < key.size(); ++i) 
+            h = (h ^ (unsigned char)key[i]) * 16777619u;
+        return h;
+    }
+private:
+    enum { virtual_nodes = 100 };
+    std::vector< boost::shared_ptr<upstream> > upstreams_;
+    std::map<boost::uint32_t,size_t> ring_; // consistent hashing
+    size_t pool_size_;
+    bool hash_;
+    deadline_timer timer_;
+};
+balancer lb;
 
 #define MEM_FN(x)       boost::bind(&self_type::x, shared_from_this())
 #define MEM_FN1(x,y)    boost::bind(&self_type::x, shared_from_this(),y)
@@ -21,8 +194,9 @@ using boost::ref;
 class proxy : public boost::enable_shared_from_this<proxy>
                   , boost::noncopyable {
     typedef proxy self_type;
-    proxy(ip::tcp::endpoint ep_client, ip::tcp::endpoint ep_server) 
-            : client_(service), server_(service), started_(0) {
+    proxy() : client_(service), server_(service), started_(0)
+            , use_splice_(use_splice), upstream_(0)
+            , to_server_buff_(client_, server_), to_client_buff_(server_, client_) {
     }
     void start_impl(ip::tcp::endpoint ep_client, ip::tcp::endpoint ep_svr) {
         client_.async_connect(ep_client, MEM_FN1(on_connect,_1));
@@ -32,14 +206,40 @@ public:
     typedef boost::system::error_code error_code;
     typedef boost::shared_ptr<proxy> ptr;
     static ptr start(ip::tcp::endpoint ep_client, ip::tcp::endpoint ep_svr) {
-        ptr new_(new proxy(ep_client, ep_svr));
+        ptr new_(new proxy);
         new_->start_impl(ep_client, ep_svr); return new_;
     }
+    // listening mode: accept into client(), then call start_upstream()
+    static ptr new_() {
+        ptr new_(new proxy);
+        return new_;
+    }
+    ~proxy() {
+        if ( upstream_) --upstream_->active;
+    }
+    ip::tcp::socket & client() { return client_; }
+    void start_upstream() {
+        started_ = 1; // the client is connected
+        error_code err;
+        ip::tcp::endpoint peer = client_.remote_endpoint(err);
+        if ( err) return;
+        upstream_ = &lb.choose(peer.address());
+        ++upstream_->active;
+        ++upstream_->served;
+        socket_ptr pooled = lb.take(*upstream_);
+        if ( pooled) {
+            server_.assign(upstream_->ep.protocol(), pooled->release());
+            on_connect(error_code());
+        } else
+            server_.async_connect(upstream_->ep, 
+                MEM_FN2(on_upstream_connect,balancer::clock::now(),_1));
+    }
     void stop() {
         if ( started_ < 2) return;
         started_ = 0;
         client_.close();
         server_.close();
+        close_pipes();
     }
     bool started() { return started_ == 2; }
 private:
@@ -48,47 +248,275 @@ private:
             if ( ++started_ == 2) on_start();
         } else stop();
     }
+    void on_upstream_connect(balancer::clock::time_point start, const error_code & err) {
+        lb.on_connected(*upstream_, start, err);
+        on_connect(err);
+    }
     void on_start() {
-        do_read(client_, buff_client_);
-        do_read(server_, buff_server_);
+        if ( use_splice_ && start_splice()) return;
+        use_splice_ = false;
+        start_buffered();
     }
-    void on_read(ip::tcp::socket & sock, const error_code& err, size_t bytes) {
+
+    /** buffered mode: each direction has its own ring buffer, and reading
+        from one party overlaps with writing to the other
+        - we keep reading while less than high_water bytes wait to be
+          written; after that, reading pauses until the receiver catches up
+        - we write everything buffered at once (both halves of the ring),
+          and a partial write just leaves the rest for the next one
+        - once a party closes its side, we forward what's left, then shut
+          down the other party's receiving side; when both are done, we stop
+    */
+    struct direction {
+        direction(ip::tcp::socket & from, ip::tcp::socket & to) 
+            : from(from), to(to), buff(buff_size)
+            , reading(false), writing(false), eof(false), done(false) {}
+        ip::tcp::socket & from, & to;
+        ring_buffer buff;
+        bool reading, writing;
+        bool eof;   // "from" closed its side
+        bool done;  // ... and we forwarded everything
+    };
+    void start_buffered() {
+        do_read(to_server_buff_);
+        do_read(to_client_buff_);
+    }
+    void do_read(direction & d) {
+        if ( d.reading || d.eof || d.buff.size() >= high_water) return;
+        d.reading = true;
+        d.from.async_read_some(d.buff.prepare(), MEM_FN3(on_read,ref(d),_1,_2));
+    }
+    void on_read(direction & d, const error_code & err, size_t bytes) {
+        d.reading = false;
+        if ( err == error::eof) d.eof = true;
+        else if ( err) stop();
+        if ( !started() ) return;
+        d.buff.commit(bytes);
+        do_write(d);
+        do_read(d);
+    }
+    void do_write(direction & d) {
+        if ( d.writing) return;
+        if ( d.buff.empty()) {
+            if ( d.eof) on_direction_done(d);
+            return;
+        }
+        d.writing = true;
+        d.to.async_write_some(d.buff.data(), MEM_FN3(on_write,ref(d),_1,_2));
+    }
+    void on_write(direction & d, const error_code & err, size_t bytes) {
+        d.writing = false;
         if ( err) stop();
         if ( !started() ) return;
-        // forward this to the other party
-        char * buff = &sock == &client_ ? buff_client_ : buff_server_;
-        do_write(&sock == &client_ ? server_ : client_, buff, bytes);
+        d.buff.consume(bytes);
+        do_write(d);
+        do_read(d); // in case we were above the high water mark
+    }
+    void on_direction_done(direction & d) {
+        if ( d.done) return;
+        d.done = true;
+        error_code ignored;
+        d.to.shutdown(ip::tcp::socket::shutdown_send, ignored);
+        if ( to_server_buff_.done && to_client_buff_.done) stop();
     }
-    void on_write(ip::tcp::socket & sock, const error_code &err, size_t bytes){
-        if ( &sock == &client_) do_read(server_, buff_server_);
-        else                    do_read(client_, buff_client_);
+
+#ifdef __linux__
+    /** splice mode: each direction has a pipe, and the data goes
+        socket -> pipe -> socket without ever being copied to us
+        - we wait (async_wait) until the source is readable, then move as
+          much as the pipe holds in one call
+        - if the destination can't take it all, we wait until it's writable
+        - both directions work independently of each other
+        - once a party closes its side, the pipe is already empty (we only
+          read into an empty pipe), so we shut down the other party's
+          receiving side; when both directions are done, we stop
+        If the kernel can't splice these sockets, we fall back to the
+        buffered path (as long as no data went through a pipe yet)
+    */
+    struct splice_pipe {
+        splice_pipe() : pending(0), capacity(0), done(false) { fd[0] = fd[1] = -1; }
+        int fd[2];
+        size_t pending; // bytes in the pipe, not yet written out
+        size_t capacity;
+        bool done;      // the source closed its side, and we forwarded everything
+    };
+    bool start_splice() {
+        if ( !open_pipe(to_server_) || !open_pipe(to_client_)) {
+            close_pipes();
+            return false;
+        }
+        client_.native_non_blocking(true);
+        server_.native_non_blocking(true);
+        wait_readable(client_);
+        wait_readable(server_);
+        return true;
     }
-    void do_read(ip::tcp::socket & sock, char* buff) {
-        async_read(sock, buffer(buff, max_msg), 
-                   MEM_FN3(read_complete,ref(sock),_1,_2), 
-                   MEM_FN3(on_read,ref(sock),_1,_2));
+    static bool open_pipe(splice_pipe & p) {
+        if ( ::pipe2(p.fd, O_NONBLOCK | O_CLOEXEC) < 0) return false;
+        ::fcntl(p.fd[1], F_SETPIPE_SZ, splice_size);
+        int capacity = ::fcntl(p.fd[1], F_GETPIPE_SZ);
+        p.capacity = capacity > 0 ? capacity : 65536;
+        return true;
     }
-    void do_write(ip::tcp::socket & sock, char * buff, size_t size) {
+    splice_pipe & pipe_from(ip::tcp::socket & sock) {
+        return &sock == &client_ ? to_server_ : to_client_;
+    }
+    void wait_readable(ip::tcp::socket & from) {
+        from.async_wait(socket_base::wait_read, MEM_FN2(on_splice_ready,ref(from),_1));
+    }
+    void wait_writable(ip::tcp::socket & from) {
+        ip::tcp::socket & to = &from == &client_ ? server_ : client_;
+        to.async_wait(socket_base::wait_write, MEM_FN2(on_splice_ready,ref(from),_1));
+    }
+    void on_splice_ready(ip::tcp::socket & from, const error_code & err) {
+        if ( !use_splice_) return; // we fell back to the buffered path
+        if ( err) stop();
         if ( !started() ) return;
-        sock.async_write_some(buffer(buff,size), 
-                              MEM_FN3(on_write,ref(sock),_1,_2));
+        do_splice(from);
+    }
+    // moves data from "from" to the other party until one of them would block
+    void do_splice(ip::tcp::socket & from) {
+        ip::tcp::socket & to = &from == &client_ ? server_ : client_;
+        splice_pipe & p = pipe_from(from);
+        // don't hog the thread - the other direction needs to run too
+        for ( int round = 0; round < max_rounds; ++round) {
+            if ( p.pending == 0) {
+                ssize_t bytes = ::splice(from.native_handle(), 0, p.fd[1], 0, p.capacity, 
+                                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if ( bytes == 0) { on_splice_done(from); return; } // closed
+                if ( bytes < 0) {
+                    if ( errno == EAGAIN) wait_readable(from);
+                    else if ( errno == EINVAL || errno == ENOSYS) fall_back();
+                    else stop();
+                    return;
+                }
+                p.pending = bytes;
+            }
+            ssize_t bytes = ::splice(p.fd[0], 0, to.native_handle(), 0, p.pending, 
+                                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if ( bytes < 0) {
+                if ( errno == EAGAIN) wait_writable(from);
+                else stop();
+                return;
+            }
+            p.pending -= bytes;
+        }
+        service.post( MEM_FN2(on_splice_ready,ref(from),error_code()));
+    }
+    void on_splice_done(ip::tcp::socket & from) {
+        splice_pipe & p = pipe_from(from);
+        if ( p.done) return;
+        p.done = true;
+        ip::tcp::socket & to = &from == &client_ ? server_ : client_;
+        error_code ignored;
+        to.shutdown(ip::tcp::socket::shutdown_send, ignored);
+        if ( to_server_.done && to_client_.done) stop();
     }
-    size_t read_complete(ip::tcp::socket & sock, 
-                         const error_code & err, size_t bytes) {
-        if ( sock.available() > 0) return sock.available();
-        return bytes > 0 ? 0 : 1;
+    void fall_back() {
+        if ( to_server_.pending > 0 || to_client_.pending > 0) {
+            stop();
+            return;
+        }
+        use_splice_ = false;
+        close_pipes();
+        client_.cancel();
+        server_.cancel();
+        client_.native_non_blocking(false);
+        server_.native_non_blocking(false);
+        start_buffered();
     }
+    void close_pipes() {
+        splice_pipe * pipes[] = { &to_server_, &to_client_ };
+        for ( int i = 0; i < 2; ++i) 
+            for ( int j = 0; j < 2; ++j) 
+                if ( pipes[i]->fd[j] >= 0) {
+                    ::close(pipes[i]->fd[j]);
+                    pipes[i]->fd[j] = -1;
+                }
+    }
+#else
+    bool start_splice() { return false; }
+    void close_pipes() {}
+#endif
 private:
     ip::tcp::socket client_, server_;
-    enum { max_msg = 1024 };
-    char buff_client_[max_msg], buff_server_[max_msg];
     int started_;
+    bool use_splice_;
+    upstream * upstream_;
+    enum { buff_size = 64 * 1024, high_water = 48 * 1024 };
+    direction to_server_buff_, to_client_buff_;
+#ifdef __linux__
+    enum { splice_size = 1024 * 1024, max_rounds = 16 };
+    splice_pipe to_server_, to_client_;
+#endif
 };
 
+ip::tcp::acceptor acceptor(service);
+void handle_accept(proxy::ptr client, const boost::system::error_code & err);
+// only the pending accept holds the new proxy - once it's done, the proxy
+// goes away with its last handler, and gives back its upstream
+void start_accept() {
+    proxy::ptr client = proxy::new_();
+    acceptor.async_accept(client->client(), boost::bind(handle_accept,client,_1));
+}
+void handle_accept(proxy::ptr client, const boost::system::error_code & err) {
+    if ( !err) client->start_upstream();
+    start_accept();
+}
+
+signal_set stats_signal(service);
+void on_stats_signal(const boost::system::error_code & err, int) {
+    if ( err) return;
+    lb.dump_stats();
+    stats_signal.async_wait(on_stats_signal);
+}
+
+ip::tcp::endpoint parse_endpoint(const std::string & host_port) {
+    std::string::size_type colon = host_port.rfind(':');
+    return ip::tcp::endpoint( ip::address::from_string(host_port.substr(0, colon)), 
+                              std::atoi(host_port.c_str() + colon + 1));
+}
+
+/** usage: proxy [--splice] [--listen port --upstream host:port... [--pool n] [--hash]]
+    - default: connects 127.0.0.1:8001 to 127.0.0.1:8002
+    - --listen: accepts clients on "port" and forwards each one to one of
+      the upstream servers (see balancer); --upstream can be repeated
+    - --splice: forward with splice() (Linux)
+*/
 int main(int argc, char* argv[]) {
-    ip::tcp::endpoint ep_c( ip::address::from_string("127.0.0.1"), 8001);
-    ip::tcp::endpoint ep_s( ip::address::from_string("127.0.0.1"), 8002);
-    proxy::start(ep_c, ep_s);
+    int listen_port = 0;
+    size_t pool_size = 4;
+    bool consistent_hash = false;
+    for ( int i = 1; i < argc; ++i) {
+        if ( std::strcmp(argv[i], "--splice") == 0) use_splice = true;
+        else if ( std::strcmp(argv[i], "--hash") == 0) consistent_hash = true;
+        else if ( i + 1 < argc && std::strcmp(argv[i], "--listen") == 0) 
+            listen_port = std::atoi(argv[++i]);
+        else if ( i + 1 < argc && std::strcmp(argv[i], "--pool") == 0) 
+            pool_size = std::atoi(argv[++i]);
+        else if ( i + 1 < argc && std::strcmp(argv[i], "--upstream") == 0) 
+            lb.add( parse_endpoint(argv[++i]));
+    }
+    if ( listen_port == 0) {
+        ip::tcp::endpoint ep_c( ip::address::from_string("127.0.0.1"), 8001);
+        ip::tcp::endpoint ep_s( ip::address::from_string("127.0.0.1"), 8002);
+        proxy::start(ep_c, ep_s);
+        service.run();
+        return 0;
+    }
+    if ( lb.empty()) {
+        std::cout << "--listen needs at least one --upstream" << std::endl;
+        return 1;
+    }
+    ip::tcp::endpoint ep(ip::tcp::v4(), listen_port);
+    acceptor.open(ep.protocol());
+    acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+    acceptor.bind(ep);
+    acceptor.listen();
+    lb.start(pool_size, consistent_hash);
+    stats_signal.add(SIGUSR1);
+    stats_signal.async_wait(on_stats_signal);
+    start_accept();
     service.run();
 }
 
@@ -12,6 +12,7 @@
 
 #include "coroutine.hpp"
 #include "yield.hpp"
+#include "../common/write_queue.hpp"
 
 using namespace boost::asio;
 io_service service;
@@ -54,10 +55,11 @@ public:
             for (;;) {
                 if ( !started_) {
                     started_ = true;
-                    std::ostream out(&write_buffer_);
-                    out << "login " << username_ << "\n";
+                    do_write("login " + username_ + "\n");
                 }
-                yield async_write(sock_, write_buffer_, MEM_FN2(step,_1,_2) );
+                // everything we queued since the last write, in one go
+                yield async_write(sock_, write_queue_.start_write(), MEM_FN2(step,_1,_2) );
+                write_queue_.end_write();
                 yield async_read_until( sock_, read_buffer_, "\n", MEM_FN2(step,_1,_2));
                 yield service.post( MEM_FN(on_answer_from_server));
             }
@@ -72,7 +74,7 @@ private:
         else if ( word == "clients") on_clients();
         else std::cerr << "invalid msg " << std::endl;
         read_buffer_.consume( read_buffer_.size());
-        if ( write_buffer_.size() > 0)
+        if ( write_queue_.pending())
             service.post( MEM_FN2(step,error_code(),0));
     }
 
@@ -95,7 +97,7 @@ private:
     }
 
     void do_ping() {
-        std::ostream out(&write_buffer_); out << "ping\n";
+        do_write("ping\n");
         service.post( MEM_FN2(step,error_code(),0));
     }
     void postpone_ping() {
@@ -108,12 +110,17 @@ private:
         timer_.async_wait( MEM_FN(do_ping));
     }
     void do_ask_clients() {
-        std::ostream out(&write_buffer_); out << "ask_clients\n";
+        do_write("ask_clients\n");
+    }
+    void do_write(const std::string & msg) {
+        // sent by step(), after the current answer is processed
+        write_queue_.push(msg);
     }
 
 private:
     ip::tcp::socket sock_;
-    streambuf read_buffer_, write_buffer_;
+    streambuf read_buffer_;
+    write_queue write_queue_;
     bool started_;
     std::string username_;
     deadline_timer timer_;
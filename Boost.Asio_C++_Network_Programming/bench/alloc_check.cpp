@@ -0,0 +1,135 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <boost/atomic.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+using namespace boost::asio;
+io_service service;
+
+/** checks that a server, once a connection is warmed up, doesn't allocate
+    per message - on the real server, not a copy of its code:
+    - starts the server with alloc_counter.so preloaded, which counts every
+      operator new of the server into a file we map too
+    - logs in on port 8001, and pings "warm-up" times (so the io_service,
+      the buffers, the queues and the threads' own state are all set up)
+    - then counts the server's allocations during "rounds" more pings,
+      each waiting for its answer
+    Fails (exit code 1) if there was any.
+
+    With async_server_multi_threaded, this covers the strand-wrapped
+    handlers too (strand_.wrap(make_custom_alloc_handler(...))).
+*/
+typedef boost::atomic<size_t> counter_type;
+
+// the server, with the counter preloaded; its stdout goes to /dev/null
+pid_t start_server(const std::string & counter_so, const std::string & counter_file,
+                   std::vector<char*> & args) {
+    pid_t pid = fork();
+    if ( pid != 0) return pid;
+    setenv("LD_PRELOAD", counter_so.c_str(), 1);
+    setenv("ALLOC_COUNTER_FILE", counter_file.c_str(), 1);
+    int null = open("/dev/null", O_WRONLY);
+    if ( null >= 0) dup2(null, 1);
+    args.push_back(0);
+    execv(args[0], &args[0]);
+    std::perror(args[0]);
+    _exit(127);
+}
+
+// retries until the server listens (or has exited)
+bool connect(ip::tcp::socket & sock, pid_t server) {
+    ip::tcp::endpoint ep(ip::address::from_string("127.0.0.1"), 8001);
+    for ( int i = 0; i < 100; ++i) {
+        boost::system::error_code err;
+        sock.connect(ep, err);
+        if ( !err) return true;
+        sock.close();
+        int status;
+        if ( waitpid(server, &status, WNOHANG) == server) return false;
+        boost::this_thread::sleep( boost::posix_time::millisec(50));
+    }
+    return false;
+}
+
+// sends "msg", waits for its answer
+std::string ask(ip::tcp::socket & sock, streambuf & buff, const std::string & msg) {
+    write(sock, buffer(msg));
+    read_until(sock, buff, '\n');
+    std::istream in(&buff);
+    std::string answer;
+    std::getline(in, answer);
+    return answer;
+}
+
+/** usage: alloc_check [--warm-up count] [--rounds count] server [server args]
+    - "warm-up" pings (default 1000) before we count, then "rounds"
+      (default 5000) that must not allocate
+    - alloc_counter.so is expected next to alloc_check
+*/
+int main(int argc, char* argv[]) {
+    size_t warm_up = 1000, rounds = 5000;
+    int i = 1;
+    for ( ; i + 1 < argc && argv[i][0] == '-'; ++i) {
+        std::string arg = argv[i];
+        if ( arg == "--warm-up") warm_up = std::atoi(argv[++i]);
+        else if ( arg == "--rounds") rounds = std::atoi(argv[++i]);
+    }
+    if ( i >= argc) {
+        std::fprintf(stderr, "usage: alloc_check [--warm-up count] [--rounds count] server [server args]\n");
+        return 2;
+    }
+    std::vector<char*> args(argv + i, argv + argc);
+    std::string self = argv[0];
+    std::string counter_so = (self.find('/') == std::string::npos ? "." : self.substr(0, self.rfind('/')))
+                           + "/alloc_counter.so";
+
+    char counter_file[] = "/tmp/alloc_check.XXXXXX";
+    int fd = mkstemp(counter_file);
+    if ( fd < 0 || ftruncate(fd, sizeof(counter_type)) != 0) {
+        std::perror("alloc_check: counter file");
+        return 2;
+    }
+    void * shared = mmap(0, sizeof(counter_type), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( shared == MAP_FAILED) {
+        std::perror("alloc_check: mmap");
+        return 2;
+    }
+    const counter_type & allocations = *static_cast<counter_type*>(shared);
+
+    pid_t server = start_server(counter_so, counter_file, args);
+    ip::tcp::socket sock(service);
+    int result = 1;
+    if ( connect(sock, server)) {
+        streambuf buff;
+        ask(sock, buff, "login alloc_check\n");
+        for ( size_t r = 0; r < warm_up; ++r) ask(sock, buff, "ping\n");
+        size_t before = allocations.load();
+        size_t done = 0;
+        for ( ; done < rounds; ++done)
+            if ( ask(sock, buff, "ping\n").compare(0, 4, "ping") != 0) break;
+        size_t counted = allocations.load() - before;
+        std::printf("%s: %lu pings, %lu allocations\n", args[0], (unsigned long)done, (unsigned long)counted);
+        if ( before == 0)
+            std::printf("FAILED: counted nothing - was %s preloaded?\n", counter_so.c_str());
+        else if ( done < rounds)
+            std::printf("FAILED: only %lu of %lu pings answered\n", (unsigned long)done, (unsigned long)rounds);
+        else if ( counted > 0)
+            std::printf("FAILED: a warmed up connection should not allocate\n");
+        else
+            result = 0;
+    } else
+        std::printf("FAILED: could not connect to %s\n", args[0]);
+
+    kill(server, SIGTERM);
+    waitpid(server, 0, 0);
+    unlink(counter_file);
+    return result;
+}
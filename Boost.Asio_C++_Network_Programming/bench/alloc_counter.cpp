@@ -0,0 +1,28 @@
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "count_allocations.hpp"
+
+/** preloaded into a server by alloc_check (LD_PRELOAD=bin/alloc_counter.so):
+    counts every operator new of the server into the file named by
+    ALLOC_COUNTER_FILE, which alloc_check maps too - so it can read the
+    count while the server runs
+*/
+namespace {
+
+struct attach {
+    attach() {
+        const char * file = std::getenv("ALLOC_COUNTER_FILE");
+        if ( !file) return;
+        int fd = open(file, O_RDWR);
+        if ( fd < 0) return;
+        void * shared = mmap(0, sizeof(boost::atomic<size_t>), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if ( shared == MAP_FAILED) return;
+        count_allocations::counter = static_cast< boost::atomic<size_t>* >(shared);
+        count_allocations::start();
+    }
+} attached;
+
+}
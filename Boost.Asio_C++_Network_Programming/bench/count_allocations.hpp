@@ -0,0 +1,43 @@
+#ifndef BENCH_COUNT_ALLOCATIONS_HPP
+#define BENCH_COUNT_ALLOCATIONS_HPP
+
+#include <cstdlib>
+#include <new>
+#include <boost/atomic.hpp>
+
+/** counts every operator new of the program, while counting is on:
+    - replaces the global operator new / delete - include it in one
+      translation unit only
+    - by default we count into "own"; alloc_counter.cpp points counter at
+      memory it shares with another process
+*/
+namespace count_allocations {
+
+boost::atomic<size_t> own(0);
+boost::atomic<size_t> * counter = &own;
+boost::atomic<bool> counting(false);
+
+inline void start() { counting.store(true); }
+inline void stop() { counting.store(false); }
+inline size_t count() { return counter->load(); }
+
+}
+
+#if __cplusplus >= 201103L
+void * operator new(std::size_t size) {
+#else
+void * operator new(std::size_t size) throw(std::bad_alloc) {
+#endif
+    if ( count_allocations::counting.load(boost::memory_order_relaxed))
+        count_allocations::counter->fetch_add(1, boost::memory_order_relaxed);
+    void * p = std::malloc(size ? size : 1);
+    if ( !p) throw std::bad_alloc();
+    return p;
+}
+#if __cplusplus >= 201103L
+void operator delete(void * p) noexcept { std::free(p); }
+#else
+void operator delete(void * p) throw() { std::free(p); }
+#endif
+
+#endif
@@ -0,0 +1,330 @@
+#ifdef WIN32
+#define _WIN32_WINNT 0x0501
+#include <stdio.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <boost/chrono.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include "../common/line_buffer.hpp"
+#include "../common/latency_histogram.hpp"
+using namespace boost::asio;
+io_service service;
+typedef boost::chrono::steady_clock clock_type;
+
+inline boost::uint64_t to_micros(clock_type::duration d) {
+    return boost::chrono::duration_cast<boost::chrono::microseconds>(d).count();
+}
+
+#define MEM_FN(x)       boost::bind(&self_type::x, shared_from_this())
+#define MEM_FN1(x,y)    boost::bind(&self_type::x, shared_from_this(),y)
+#define MEM_FN2(x,y,z)  boost::bind(&self_type::x, shared_from_this(),y,z)
+
+// what every echo needs, shared by all workers (we're single threaded)
+struct echo_stats {
+    echo_stats() : done(0), errors(0) {}
+    latency_histogram latency;
+    size_t done, errors;
+};
+
+class echo_worker;
+typedef boost::shared_ptr<echo_worker> worker_ptr;
+
+/** the echoes waiting for a free worker, each with the time it was due
+    - open loop: a timer queues them at the given rate
+    - closed loop (rate 0): a worker that's done starts the next one
+*/
+struct echo_queue {
+    echo_queue() : closed_loop(false), stopped(false) {}
+    std::deque<clock_type::time_point> due;
+    std::vector<worker_ptr> idle;
+    bool closed_loop, stopped;
+};
+
+/** one echo at a time, against the Chapter_3 echo servers:
+    - tcp: connect, send the message, read the echo, then wait for the
+      server to close (so that TIME_WAIT stays on the server's side, and we
+      don't run out of ports)
+    - udp: send a datagram, wait for it to come back (up to 1 second);
+      the datagram starts with a sequence number, so an echo that comes
+      back after its timeout isn't taken for the next one
+    - the latency is measured from the time the echo was due
+*/
+class echo_worker : public boost::enable_shared_from_this<echo_worker>
+                  , boost::noncopyable {
+    typedef echo_worker self_type;
+public:
+    typedef boost::system::error_code error_code;
+
+    echo_worker(bool udp, ip::tcp::endpoint ep, const std::string & msg,
+                echo_stats & stats, echo_queue & queue)
+        : udp_(udp), ep_(ep), msg_(msg), tcp_(service), udp_sock_(service)
+        , read_buffer_(max_msg), timer_(service), stats_(stats), queue_(queue)
+        , busy_(false), recorded_(false), receiving_(false), sequence_(0) {
+        if ( udp_) {
+            udp_sock_.open(ip::udp::v4());
+            udp_sock_.connect( ip::udp::endpoint(ep.address(), ep.port()));
+        }
+    }
+    void start(clock_type::time_point due) {
+        busy_ = true;
+        due_ = due;
+        if ( udp_) {
+            char seq[16];
+            size_t len = std::min<size_t>( std::sprintf(seq, "%08x", unsigned(sequence_++)),
+                                           msg_.size() - 1);
+            msg_.replace(0, len, seq, len);
+            if ( !receiving_) do_udp_read();
+            udp_sock_.async_send( buffer(msg_), MEM_FN2(on_udp_sent,_1,_2));
+            timer_.expires_from_now( boost::posix_time::seconds(1));
+            timer_.async_wait( MEM_FN1(on_timeout,_1));
+        } else {
+            read_buffer_.clear();
+            tcp_.async_connect(ep_, MEM_FN1(on_connect,_1));
+        }
+    }
+    // the load is over - a busy worker stops once its echo is done
+    void stop() {
+        if ( !busy_) close();
+    }
+private:
+    // tcp
+    void on_connect(const error_code & err) {
+        if ( err) { done(false); return; }
+        async_write(tcp_, buffer(msg_), MEM_FN2(on_write,_1,_2));
+    }
+    void on_write(const error_code & err, size_t) {
+        if ( err) { done(false); return; }
+        tcp_.async_read_some(read_buffer_.prepare(), MEM_FN2(on_read,_1,_2));
+    }
+    void on_read(const error_code & err, size_t bytes) {
+        if ( err) { done(false); return; }
+        read_buffer_.commit(bytes);
+        const char * line; size_t len;
+        if ( read_buffer_.next_line(line, len)) {
+            bool ok = len + 1 == msg_.size() && std::memcmp(line, msg_.data(), len) == 0;
+            record(ok);
+            if ( !ok) { done(false); return; }
+            tcp_.async_read_some(buffer(drain_), MEM_FN2(on_drain,_1,_2));
+        } else if ( read_buffer_.overflow())
+            done(false);
+        else
+            tcp_.async_read_some(read_buffer_.prepare(), MEM_FN2(on_read,_1,_2));
+    }
+    // the echo servers close once they've answered
+    void on_drain(const error_code & err, size_t) {
+        if ( err) done(true);
+        else tcp_.async_read_some(buffer(drain_), MEM_FN2(on_drain,_1,_2));
+    }
+
+    // udp: we keep a receive pending all the time
+    void do_udp_read() {
+        receiving_ = true;
+        udp_sock_.async_receive( buffer(udp_buffer_), MEM_FN2(on_udp_read,_1,_2));
+    }
+    void on_udp_sent(const error_code & err, size_t) {
+        if ( err) { timer_.cancel(); done(false); }
+    }
+    void on_udp_read(const error_code & err, size_t bytes) {
+        receiving_ = false;
+        if ( err) return; // closed
+        if ( busy_ && bytes == msg_.size() && std::memcmp(udp_buffer_, msg_.data(), bytes) == 0) {
+            timer_.cancel();
+            record(true);
+            done(true);
+        }
+        // otherwise, a late echo - its timeout counted it as an error
+        if ( udp_sock_.is_open() && !receiving_) do_udp_read();
+    }
+    void on_timeout(const error_code & err) {
+        if ( err || !busy_) return;
+        record(false);
+        done(true);
+    }
+
+    void record(bool ok) {
+        if ( ok) {
+            ++stats_.done;
+            stats_.latency.record( to_micros(clock_type::now() - due_));
+        } else
+            ++stats_.errors;
+        recorded_ = true;
+    }
+    // the echo is over (recorded or not) - on to the next one
+    void done(bool recorded) {
+        if ( !recorded && !recorded_) ++stats_.errors;
+        recorded_ = false;
+        busy_ = false;
+        error_code ignore;
+        if ( !udp_) tcp_.close(ignore);
+        if ( queue_.stopped) { close(); return; }
+        if ( queue_.closed_loop) start( clock_type::now());
+        else if ( !queue_.due.empty()) {
+            clock_type::time_point due = queue_.due.front();
+            queue_.due.pop_front();
+            start(due);
+        } else
+            queue_.idle.push_back( shared_from_this());
+    }
+    void close() {
+        error_code ignore;
+        tcp_.close(ignore);
+        udp_sock_.close(ignore);
+        timer_.cancel();
+    }
+private:
+    bool udp_;
+    ip::tcp::endpoint ep_;
+    std::string msg_;
+    ip::tcp::socket tcp_;
+    ip::udp::socket udp_sock_;
+    enum { max_msg = 1024 };
+    line_buffer read_buffer_;
+    char drain_[64];
+    char udp_buffer_[max_msg];
+    deadline_timer timer_;
+    echo_stats & stats_;
+    echo_queue & queue_;
+    clock_type::time_point due_;
+    bool busy_, recorded_, receiving_;
+    size_t sequence_;
+};
+
+// open loop: echo i is due at start + i / rate; the timer wakes us up
+// when the next one is due, and we hand it to an idle worker
+class echo_pacer {
+public:
+    echo_pacer(echo_queue & queue, double rate)
+        : queue_(queue), rate_(rate), timer_(service), start_(clock_type::now()), issued_(0) {
+        tick();
+    }
+private:
+    clock_type::time_point due_at(boost::uint64_t i) const {
+        return start_ + boost::chrono::microseconds( boost::uint64_t(i * 1e6 / rate_));
+    }
+    void tick() {
+        long wait = long( to_micros( due_at(issued_) - clock_type::now()));
+        timer_.expires_from_now( boost::posix_time::microseconds(wait > 0 ? wait : 0));
+        timer_.async_wait( boost::bind(&echo_pacer::on_tick, this, _1));
+    }
+    void on_tick(const boost::system::error_code & err) {
+        if ( err || queue_.stopped) return;
+        clock_type::time_point now = clock_type::now();
+        for ( ; due_at(issued_) <= now; ++issued_)
+            queue_.due.push_back( due_at(issued_));
+        while ( !queue_.idle.empty() && !queue_.due.empty()) {
+            worker_ptr worker = queue_.idle.back();
+            queue_.idle.pop_back();
+            clock_type::time_point when = queue_.due.front();
+            queue_.due.pop_front();
+            worker->start(when);
+        }
+        tick();
+    }
+private:
+    echo_queue & queue_;
+    double rate_;
+    deadline_timer timer_;
+    clock_type::time_point start_;
+    boost::uint64_t issued_;
+};
+
+void stop_load(echo_queue * queue, std::vector<worker_ptr> * workers) {
+    queue->stopped = true;
+    for ( size_t i = 0; i < workers->size(); ++i) (*workers)[i]->stop();
+}
+
+/** usage: echo_load [--udp] [--host address] [--port port] [--size bytes]
+                     [--concurrency count] [--rate echoes/s] [--duration secs]
+                     [--csv file]
+    - load for the Chapter_3 echo servers: "concurrency" workers (default
+      16) echo messages of "size" bytes (default 32, enter included, at
+      most 1024) - over tcp (a connection per echo) or udp
+    - "rate" echoes per second (default 0 = as fast as the server answers);
+      echoes that are due while every worker is busy wait for one, and
+      their latency includes the wait
+    - --csv: append the results as one line to "file" (with a header line,
+      if it's a new file)
+*/
+int main(int argc, char* argv[]) {
+    std::string host = "127.0.0.1", csv_file;
+    unsigned short port = 8001;
+    bool udp = false;
+    size_t size = 32, concurrency = 16;
+    double rate = 0, duration = 5;
+    for ( int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ( arg == "--udp") { udp = true; continue; }
+        if ( i + 1 == argc) { std::cerr << "missing value for " << arg << std::endl; return 1; }
+        std::string value = argv[++i];
+        if ( arg == "--host") host = value;
+        else if ( arg == "--port") port = (unsigned short)std::atoi(value.c_str());
+        else if ( arg == "--size") size = std::atoi(value.c_str());
+        else if ( arg == "--concurrency") concurrency = std::atoi(value.c_str());
+        else if ( arg == "--rate") rate = std::atof(value.c_str());
+        else if ( arg == "--duration") duration = std::atof(value.c_str());
+        else if ( arg == "--csv") csv_file = value;
+        else { std::cerr << "unknown option " << arg << std::endl; return 1; }
+    }
+    if ( size < 2 || size > 1024 || concurrency == 0 || duration <= 0) {
+        std::cerr << "invalid options" << std::endl;
+        return 1;
+    }
+    ip::tcp::endpoint ep( ip::address::from_string(host), port);
+    std::string msg;
+    for ( size_t i = 0; i + 1 < size; ++i) msg += char('a' + i % 26);
+    msg += "\n";
+
+    echo_stats stats;
+    echo_queue queue;
+    queue.closed_loop = rate <= 0;
+    std::vector<worker_ptr> workers;
+    for ( size_t i = 0; i < concurrency; ++i)
+        workers.push_back( worker_ptr(new echo_worker(udp, ep, msg, stats, queue)));
+    boost::scoped_ptr<echo_pacer> pacer;
+    clock_type::time_point start = clock_type::now();
+    if ( queue.closed_loop)
+        for ( size_t i = 0; i < workers.size(); ++i) workers[i]->start(start);
+    else {
+        queue.idle = workers;
+        pacer.reset( new echo_pacer(queue, rate));
+    }
+    deadline_timer stop_timer(service, boost::posix_time::microseconds( long(duration * 1e6)));
+    stop_timer.async_wait( boost::bind(stop_load, &queue, &workers));
+    // after the stop, the echoes in flight finish (or time out)
+    service.run();
+    double secs = to_micros(clock_type::now() - start) / 1e6;
+    // the ones still waiting for a worker never happened
+    stats.errors += queue.due.size();
+
+    const latency_histogram & l = stats.latency;
+    std::cout << (udp ? "udp" : "tcp") << ", " << size << " bytes, concurrency "
+              << concurrency << ": " << stats.done << " echoes, " << stats.errors
+              << " errors, " << std::fixed << std::setprecision(0) << stats.done / secs
+              << " echoes/s; latency (us) mean " << l.mean() << ", p50 " << l.percentile(50)
+              << ", p99 " << l.percentile(99) << ", p99.9 " << l.percentile(99.9)
+              << ", max " << l.max() << std::endl;
+    if ( !csv_file.empty()) {
+        bool is_new = !std::ifstream(csv_file.c_str());
+        std::ofstream out(csv_file.c_str(), std::ios::app);
+        if ( is_new)
+            out << "protocol,size,concurrency,rate,echoes,errors,throughput,"
+                   "mean_us,p50_us,p99_us,p999_us,max_us\n";
+        out << (udp ? "udp" : "tcp") << "," << size << "," << concurrency << ","
+            << rate << "," << stats.done << "," << stats.errors << ","
+            << std::fixed << std::setprecision(1) << stats.done / secs << "," << l.mean() << ","
+            << l.percentile(50) << "," << l.percentile(99) << ","
+            << l.percentile(99.9) << "," << l.max() << "\n";
+    }
+}
@@ -0,0 +1,140 @@
+#!/bin/sh
+# Starts each server on localhost:8001 in turn, runs the same scenarios
+# against it, and writes one comparison table (results/results.md).
+#
+#   make && ./run.sh [server-name...]
+#
+# The scenarios:
+#   conn/s  - connections per second: tcp echoes (one connection each, 16 at
+#             a time), or chat sessions connecting + logging in all at once
+#   req/s   - requests per second over persistent connections, as fast as
+#             the server answers: pings over 100 chat sessions, or udp
+#             echoes (16 at a time); the tcp echo servers close after each
+#             echo, so they have no such number
+#   latency - p50/p99 (microseconds) at a fixed RATE, for each concurrency
+#             (connections) and message size: echoes of 32 / 512 bytes, or
+#             for the chat servers, ping (small) / ask_clients (large)
+#
+# Settings (environment): DURATION secs per run (5), RATE requests/s for the
+# latency runs (1000), CONCURRENCY list (10 1000), SIZES list (32 512).
+# The raw numbers of every run stay in results/*.csv.
+
+cd "$(dirname "$0")"
+DURATION=${DURATION:-5}
+RATE=${RATE:-1000}
+CONCURRENCY=${CONCURRENCY:-10 1000}
+SIZES=${SIZES:-32 512}
+SESSIONS=${SESSIONS:-2000}
+OUT=results
+mkdir -p $OUT
+
+# name | command line | kind (tcp = tcp echo, udp = udp echo, chat)
+SERVERS="tcp_sync_echo_server|bin/tcp_sync_echo_server|tcp
+tcp_async_echo_server|bin/tcp_async_echo_server|tcp
+udp_sync_echo_server|bin/udp_sync_echo_server|udp
+udp_sync_echo_server --batch|bin/udp_sync_echo_server --batch|udp
+sync_server|bin/sync_server|chat
+sync_server --epoll|bin/sync_server --epoll|chat
+async_server|bin/async_server|chat
+async_server_multi_threaded|bin/async_server_multi_threaded|chat
+async_server_multi_threaded --per-core|bin/async_server_multi_threaded --per-core|chat
+async_server_multi_threaded --reuseport|bin/async_server_multi_threaded --reuseport|chat"
+
+for tool in bin/echo_load bin/load_generator; do
+    [ -x $tool ] || { echo "$tool is missing - run make first" >&2; exit 1; }
+done
+
+# field of a csv: the last line (echo_load), or the row of a command
+# (load_generator)
+csv_field() { # file column [command]
+    if [ -z "$3" ]; then tail -n 1 "$1" | cut -d, -f"$2"
+    else grep "^$3," "$1" | cut -d, -f"$2"; fi
+}
+# "p50/p99", if there were no errors
+latency() { # file [command]
+    if [ -z "$2" ]; then errors=$(csv_field "$1" 6); p50=$(csv_field "$1" 9); p99=$(csv_field "$1" 10)
+    else errors=$(csv_field "$1" 4 "$2"); p50=$(csv_field "$1" 7 "$2"); p99=$(csv_field "$1" 8 "$2"); fi
+    if [ -z "$p50" ]; then echo "failed"
+    elif [ "$errors" != "0" ]; then echo "$p50/$p99 ($errors err)"
+    else echo "$p50/$p99"; fi
+}
+rate() { # number -> integer
+    if [ -z "$1" ]; then echo "failed"; else printf "%.0f" "$1"; fi
+}
+
+header="| server | conn/s | req/s |"
+line="|---|---:|---:|"
+for c in $CONCURRENCY; do for s in $SIZES; do
+    header="$header c=$c ${s}B |"; line="$line---:|"
+done; done
+table="$header
+$line"
+
+echo "$SERVERS" | while IFS='|' read name cmd kind; do
+    if [ $# -gt 0 ]; then
+        wanted=no
+        for w in "$@"; do [ "$w" = "$name" ] && wanted=yes; done
+        [ $wanted = yes ] || continue
+    fi
+    file=$(echo "$name" | sed 's/ --/-/g')
+    echo "== $name" >&2
+    $cmd > $OUT/$file.log 2>&1 &
+    pid=$!
+    sleep 1
+
+    rm -f $OUT/$file-*.csv
+    case $kind in
+    tcp)
+        bin/echo_load --duration $DURATION --concurrency 16 --csv $OUT/$file-conn.csv >&2
+        conn=$(rate $(csv_field $OUT/$file-conn.csv 7))
+        req="-" ;;
+    udp)
+        conn="-"
+        bin/echo_load --udp --duration $DURATION --concurrency 16 --csv $OUT/$file-req.csv >&2
+        req=$(rate $(csv_field $OUT/$file-req.csv 7)) ;;
+    chat)
+        bin/load_generator --sessions $SESSIONS --connect-rate 0 --rate 1 --duration 1 \
+                           --csv $OUT/$file-conn.csv > /dev/null
+        conn=$(rate $(csv_field $OUT/$file-conn.csv 5 login))
+        bin/load_generator --sessions 100 --rate 0 --mix 100,0 --duration $DURATION \
+                           --csv $OUT/$file-req.csv > /dev/null
+        req=$(rate $(csv_field $OUT/$file-req.csv 5 all)) ;;
+    esac
+    row="| $name | $conn | $req |"
+
+    for c in $CONCURRENCY; do
+        n=0
+        for s in $SIZES; do
+            n=$((n + 1))
+            csv=$OUT/$file-c$c-$s.csv
+            case $kind in
+            tcp|udp)
+                [ $kind = udp ] && udp=--udp || udp=
+                bin/echo_load $udp --size $s --concurrency $c --rate $RATE \
+                              --duration $DURATION --csv $csv >&2
+                row="$row $(latency $csv) |" ;;
+            chat)
+                # the first size is ping, the others ask_clients
+                [ $n = 1 ] && mix=100,0 command=ping || mix=0,100 command=ask_clients
+                bin/load_generator --sessions $c --connect-rate 0 --rate $RATE --mix $mix \
+                                   --duration $DURATION --csv $csv > /dev/null
+                row="$row $(latency $csv $command) |" ;;
+            esac
+        done
+    done
+
+    kill $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    echo "$row"
+done > $OUT/rows.md
+
+{
+    echo "$table"
+    cat $OUT/rows.md
+    echo
+    echo "conn/s, req/s: per second; latency: p50/p99 in microseconds at $RATE requests/s;"
+    echo "c = concurrent connections; size: echo bytes, or ping / ask_clients for chat servers."
+    echo "$(date), $(uname -sr), $DURATION secs per run"
+} > $OUT/results.md
+rm -f $OUT/rows.md
+cat $OUT/results.md
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include "../common/line_buffer.hpp"
+#include "../common/text_protocol.hpp"
+#include "count_allocations.hpp"
+typedef boost::chrono::steady_clock clock_type;
+
+/** what the servers do with a read full of text requests, without the
+    network: split it into lines and dispatch each one
+    - old: each line copied into a std::string, the command found with a
+      chain of find(), the arguments parsed with an istringstream (the
+      servers before text_protocol.hpp)
+    - new: each line is a pointer + length into the buffer, the command
+      is looked up with text_protocol::parse(), the arguments parsed as
+      string_refs
+    Both see the same requests (a mix of login / ping / ask_clients /
+    ask_clients_since), fed to a line_buffer in 8 KB reads.
+    The new way must not allocate at all: we count its allocations, and
+    fail (exit code 1) if there's any.
+*/
+struct result {
+    result() : login(0), ping(0), clients(0), since(0), names(0) {}
+    // what the handlers would get - so the compiler can't skip the work
+    size_t login, ping, clients, since, names;
+};
+
+void dispatch_old(line_buffer & buff, result & r) {
+    std::string msg;
+    while ( buff.next_line(msg)) {
+        if ( msg.find("login ") == 0) {
+            std::istringstream in(msg);
+            std::string username;
+            in >> username >> username;
+            ++r.login;
+            r.names += username.size();
+        }
+        else if ( msg.find("ping") == 0) ++r.ping;
+        else if ( msg.find("ask_clients_since ") == 0) {
+            std::istringstream in(msg);
+            std::string word;
+            size_t since = 0;
+            in >> word >> since;
+            ++r.since;
+            r.names += since;
+        }
+        else if ( msg.find("ask_clients") == 0) ++r.clients;
+    }
+}
+
+void dispatch_new(line_buffer & buff, result & r) {
+    const char * line;
+    size_t len;
+    while ( buff.next_line(line, len)) {
+        text_protocol::string_ref args, word;
+        size_t since = 0;
+        switch ( text_protocol::parse( text_protocol::string_ref(line, len), args)) {
+        case text_protocol::login:
+            if ( text_protocol::next_word(args, word)) {
+                ++r.login;
+                r.names += word.size();
+            }
+            break;
+        case text_protocol::ping:           ++r.ping; break;
+        case text_protocol::ask_clients:    ++r.clients; break;
+        case text_protocol::ask_clients_since:
+            if ( text_protocol::next_word(args, word)) text_protocol::to_number(word, since);
+            ++r.since;
+            r.names += since;
+            break;
+        default: break;
+        }
+    }
+}
+
+// the requests, one after the other, as a client would pipeline them
+std::string make_requests(size_t count) {
+    static const char * requests[] = { "ping\n", "ping\n", "ask_clients\n", "login john_smith\n",
+                                       "ping\n", "ask_clients_since 1234\n" };
+    std::string all;
+    for ( size_t i = 0; i < count; ++i) all += requests[i % (sizeof(requests) / sizeof(requests[0]))];
+    return all;
+}
+
+// ns per request; if "counted", the allocations of the dispatch loop are counted
+template<class Dispatch> double run(Dispatch dispatch, const std::string & requests, size_t count,
+                                    size_t rounds, result & r, bool counted = false) {
+    line_buffer buff;
+    if ( counted) count_allocations::start();
+    clock_type::time_point start = clock_type::now();
+    for ( size_t round = 0; round < rounds; ++round)
+        for ( size_t at = 0; at < requests.size(); ) {
+            boost::asio::mutable_buffer free = buff.prepare();
+            size_t bytes = std::min(boost::asio::buffer_size(free), requests.size() - at);
+            std::memcpy(boost::asio::buffer_cast<char*>(free), requests.data() + at, bytes);
+            buff.commit(bytes);
+            at += bytes;
+            dispatch(buff, r);
+        }
+    boost::uint64_t ns = boost::chrono::duration_cast<boost::chrono::nanoseconds>(clock_type::now() - start).count();
+    count_allocations::stop();
+    return double(ns) / (count * rounds);
+}
+
+/** usage: text_dispatch [--messages count] [--rounds count]
+    - dispatches "messages" requests (default 100000), "rounds" times
+      (default 20), the old way and the new way; prints ns per request
+*/
+int main(int argc, char* argv[]) {
+    size_t count = 100000, rounds = 20;
+    for ( int i = 1; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if ( arg == "--messages") count = std::atoi(argv[++i]);
+        else if ( arg == "--rounds") rounds = std::atoi(argv[++i]);
+    }
+    std::string requests = make_requests(count);
+    result old_r, new_r;
+    double old_ns = run(dispatch_old, requests, count, rounds, old_r);
+    double new_ns = run(dispatch_new, requests, count, rounds, new_r, true);
+    if ( old_r.login != new_r.login || old_r.ping != new_r.ping || old_r.clients != new_r.clients
+            || old_r.since != new_r.since || old_r.names != new_r.names) {
+        std::cerr << "the two dispatchers disagree" << std::endl;
+        return 1;
+    }
+    std::printf("old (std::string + find + istringstream): %8.1f ns/request\n", old_ns);
+    std::printf("new (text_protocol::parse, string_ref):    %8.1f ns/request, %lu allocations\n",
+                new_ns, (unsigned long)count_allocations::count());
+    if ( count_allocations::count() > 0) {
+        std::printf("FAILED: the new dispatch should not allocate\n");
+        return 1;
+    }
+    return 0;
+}
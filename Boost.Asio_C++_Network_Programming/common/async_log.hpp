@@ -0,0 +1,300 @@
+#ifndef COMMON_ASYNC_LOG_HPP
+#define COMMON_ASYNC_LOG_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+/** logging that stays off the I/O threads:
+    - a log call copies its format (a string literal - only the pointer is
+      kept) and its arguments into a fixed size record, in a ring of the
+      calling thread - no lock, no formatting, no system call
+    - a background thread drains the rings every 10 ms, formats the records
+      (oldest first) and writes them in one go: debug/info to stdout,
+      warning/error to stderr
+    - if a ring is full (the writer can't keep up), the record is dropped
+      and counted - the I/O thread never waits for the log
+    - limited() lets a format through at most rate_limit times a second
+      (per thread); the next one that gets through tells how many were
+      suppressed - for messages a client can trigger at will, like
+      "invalid msg"
+
+    Usage:
+        async_log::log(async_log::info, "{} logged in", username);
+        async_log::limited(async_log::warning, "invalid msg {}", async_log::text(line, len));
+
+    Arguments: strings (cut to what fits in a record) and integers. Records
+    of different threads are ordered by time only within one batch.
+*/
+namespace async_log {
+
+typedef boost::int64_t value_type;
+
+enum level { debug, info, warning, error, off };
+inline const char * level_name(int l) {
+    static const char * names[] = { "debug", "info", "warning", "error", "off" };
+    return names[l];
+}
+// "info" -> info; false if there's no such level
+inline bool parse_level(const std::string & name, level & l) {
+    for ( int i = debug; i <= off; ++i)
+        if ( name == level_name(i)) { l = static_cast<level>(i); return true; }
+    return false;
+}
+
+// one argument of a log call - just refers to it, until it's copied
+struct arg {
+    enum kind_type { none, number, string };
+    arg() : kind(none), num(0), str(0), len(0) {}
+    arg(int n) : kind(number), num(n), str(0), len(0) {}
+    arg(unsigned n) : kind(number), num(n), str(0), len(0) {}
+    arg(long n) : kind(number), num(n), str(0), len(0) {}
+    arg(unsigned long n) : kind(number), num(n), str(0), len(0) {}
+    arg(const char * s) : kind(string), num(0), str(s), len(std::strlen(s)) {}
+    arg(const std::string & s) : kind(string), num(0), str(s.data()), len(s.size()) {}
+    arg(const char * s, size_t n) : kind(string), num(0), str(s), len(n) {}
+    kind_type kind;
+    value_type num;
+    const char * str;
+    size_t len;
+};
+// a string that isn't null terminated
+inline arg text(const char * s, size_t len) { return arg(s, len); }
+
+struct record {
+    enum { max_args = 3, text_size = 200 };
+    value_type micros;          // since the epoch
+    const char * format;
+    boost::uint32_t suppressed; // by limited(), since the last one
+    unsigned char lvl, args;
+    unsigned char kinds[max_args];
+    unsigned char lengths[max_args];
+    value_type numbers[max_args];
+    char text[text_size];       // the string arguments, one after the other
+};
+
+// one thread writes, the log's thread reads
+class ring : boost::noncopyable {
+public:
+    enum { capacity = 1024 };   // records - a power of 2
+    ring() : head_(0), tail_(0), dropped_(0), records_(capacity) {}
+
+    // the record to fill in, or null if the ring is full
+    record * prepare() {
+        value_type head = head_.load(boost::memory_order_relaxed);
+        if ( head - tail_.load(boost::memory_order_acquire) == capacity) {
+            dropped_.store( dropped_.load(boost::memory_order_relaxed) + 1, boost::memory_order_relaxed);
+            return 0;
+        }
+        return &records_[head & (capacity - 1)];
+    }
+    void commit() {
+        head_.store( head_.load(boost::memory_order_relaxed) + 1, boost::memory_order_release);
+    }
+    // appends what's ready to "out"
+    void drain(std::vector<record> & out) {
+        value_type tail = tail_.load(boost::memory_order_relaxed);
+        value_type head = head_.load(boost::memory_order_acquire);
+        for ( ; tail != head; ++tail) out.push_back( records_[tail & (capacity - 1)]);
+        tail_.store(tail, boost::memory_order_release);
+    }
+    value_type dropped() const { return dropped_.load(boost::memory_order_relaxed); }
+
+    // for limited(): format -> how often we logged it this second
+    struct limit {
+        const char * format;
+        value_type window;      // the second we're counting
+        boost::uint32_t count, suppressed;
+    };
+    enum { limit_slots = 64 };
+    limit & limit_of(const char * format) {
+        limit & l = limits_[ (reinterpret_cast<size_t>(format) >> 3) % limit_slots];
+        if ( l.format != format) {
+            // (two formats sharing a slot just share their limit)
+            l.format = format;
+            l.window = -1;
+            l.count = l.suppressed = 0;
+        }
+        return l;
+    }
+private:
+    // the writer and the reader each have a cache line of their own
+    boost::atomic<value_type> head_;
+    char pad1_[64];
+    boost::atomic<value_type> tail_;
+    char pad2_[64];
+    boost::atomic<value_type> dropped_;
+    std::vector<record> records_;
+    limit limits_[limit_slots];
+};
+
+class logger : boost::noncopyable {
+public:
+    static logger & instance() {
+        static logger l;
+        return l;
+    }
+    void set_level(level l) { level_.store(l, boost::memory_order_relaxed); }
+    bool enabled(level l) const { return l >= level_.load(boost::memory_order_relaxed); }
+    // for limited(): messages per second, per format and thread
+    void set_rate_limit(unsigned per_second) { rate_limit_ = per_second; }
+
+    void log(level l, bool limit, const char * format, const arg & a, const arg & b, const arg & c) {
+        if ( !enabled(l)) return;
+        ring & r = local();
+        value_type now = boost::chrono::duration_cast<boost::chrono::microseconds>(
+            boost::chrono::system_clock::now().time_since_epoch()).count();
+        boost::uint32_t suppressed = 0;
+        if ( limit) {
+            ring::limit & lim = r.limit_of(format);
+            value_type second = now / 1000000;
+            if ( lim.window != second) {
+                lim.window = second;
+                lim.count = 0;
+            }
+            if ( lim.count >= rate_limit_) {
+                ++lim.suppressed;
+                return;
+            }
+            ++lim.count;
+            suppressed = lim.suppressed;
+            lim.suppressed = 0;
+        }
+        record * rec = r.prepare();
+        if ( !rec) return;
+        rec->micros = now;
+        rec->format = format;
+        rec->suppressed = suppressed;
+        rec->lvl = static_cast<unsigned char>(l);
+        rec->args = 0;
+        size_t used = 0;
+        const arg * args[record::max_args] = { &a, &b, &c };
+        for ( int i = 0; i < record::max_args && args[i]->kind != arg::none; ++i) {
+            rec->kinds[i] = static_cast<unsigned char>(args[i]->kind);
+            if ( args[i]->kind == arg::number) rec->numbers[i] = args[i]->num;
+            else {
+                size_t len = std::min(args[i]->len, std::min<size_t>(record::text_size - used, 255));
+                std::memcpy(rec->text + used, args[i]->str, len);
+                rec->lengths[i] = static_cast<unsigned char>(len);
+                used += len;
+            }
+            ++rec->args;
+        }
+        r.commit();
+    }
+
+    // writes whatever the threads logged so far
+    void flush() {
+        boost::mutex::scoped_lock lk(flush_cs_);
+        std::vector<record> batch;
+        value_type dropped = 0;
+        { boost::mutex::scoped_lock rings_lk(cs_);
+          for ( size_t i = 0; i < rings_.size(); ++i) {
+              rings_[i]->drain(batch);
+              dropped += rings_[i]->dropped();
+          }
+        }
+        std::stable_sort(batch.begin(), batch.end(), older);
+        std::string out, err;
+        for ( size_t i = 0; i < batch.size(); ++i)
+            format(batch[i], batch[i].lvl >= warning ? err : out);
+        if ( dropped > dropped_) {
+            err += "log: " + to_string(dropped - dropped_) + " messages dropped - the log can't keep up\n";
+            dropped_ = dropped;
+        }
+        if ( !out.empty()) { std::fwrite(out.data(), 1, out.size(), stdout); std::fflush(stdout); }
+        if ( !err.empty()) { std::fwrite(err.data(), 1, err.size(), stderr); std::fflush(stderr); }
+    }
+private:
+    // the ring of the calling thread; the first one starts the writer
+    ring & local() {
+        ring * r = local_.get();
+        if ( !r) {
+            r = new ring;
+            local_.reset(r);
+            boost::mutex::scoped_lock lk(cs_);
+            rings_.push_back(r);
+            if ( !started_) {
+                started_ = true;
+                boost::thread( boost::bind(&logger::write_loop, this)).detach();
+            }
+        }
+        return *r;
+    }
+    void write_loop() {
+        while ( true) {
+            boost::this_thread::sleep( boost::posix_time::millisec(10));
+            flush();
+        }
+    }
+
+    static bool older(const record & a, const record & b) { return a.micros < b.micros; }
+    static std::string to_string(value_type n) {
+        char buff[24];
+        std::sprintf(buff, "%lld", static_cast<long long>(n));
+        return buff;
+    }
+    // "12:34:56.789012 info  <message>" (UTC)
+    static void format(const record & r, std::string & out) {
+        char stamp[32];
+        value_type secs = r.micros / 1000000;
+        std::sprintf(stamp, "%02d:%02d:%02d.%06d %-7s ", int(secs / 3600 % 24), int(secs / 60 % 60),
+                     int(secs % 60), int(r.micros % 1000000), level_name(r.lvl));
+        out += stamp;
+        size_t text_at = 0;
+        int next = 0;
+        for ( const char * f = r.format; *f; ++f) {
+            if ( f[0] == '{' && f[1] == '}' && next < r.args) {
+                if ( r.kinds[next] == arg::number) out += to_string(r.numbers[next]);
+                else {
+                    out.append(r.text + text_at, r.lengths[next]);
+                    text_at += r.lengths[next];
+                }
+                ++next;
+                ++f;
+            } else
+                out += *f;
+        }
+        if ( r.suppressed > 0)
+            out += " (" + to_string(r.suppressed) + " more suppressed)";
+        out += '\n';
+    }
+
+    // the rings outlive their threads - the writer still drains them
+    static void keep(ring *) {}
+    logger() : level_(info), rate_limit_(10), local_(keep), started_(false), dropped_(0) {}
+private:
+    boost::atomic<int> level_;
+    unsigned rate_limit_;
+    boost::thread_specific_ptr<ring> local_;
+    boost::mutex cs_;
+    std::vector<ring*> rings_;
+    bool started_;
+    // one flush at a time: the rings have a single reader
+    boost::mutex flush_cs_;
+    value_type dropped_;
+};
+
+inline void set_level(level l) { logger::instance().set_level(l); }
+inline void set_rate_limit(unsigned per_second) { logger::instance().set_rate_limit(per_second); }
+inline void flush() { logger::instance().flush(); }
+
+inline void log(level l, const char * format, const arg & a = arg(), const arg & b = arg(), const arg & c = arg()) {
+    logger::instance().log(l, false, format, a, b, c);
+}
+inline void limited(level l, const char * format, const arg & a = arg(), const arg & b = arg(), const arg & c = arg()) {
+    logger::instance().log(l, true, format, a, b, c);
+}
+
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef COMMON_BINARY_PROTOCOL_HPP
+#define COMMON_BINARY_PROTOCOL_HPP
+
+#include <string>
+#include "line_buffer.hpp"
+#include "text_protocol.hpp"
+
+/** the binary version of the chat protocol - same requests and answers as
+    the text one, in fewer bytes:
+    - a client that wants it sends the handshake byte first; text clients
+      start with "login", so the server can tell them apart
+    - every message is a frame: <length> <opcode> <fields>, where length
+      counts the opcode and the fields
+    - numbers (length, versions, counts) are varints: 7 bits per byte, low
+      bits first, the high bit says "more bytes follow"
+    - a string is <length> <bytes>; a list is <count> <items>
+
+    So "ping" is 2 bytes (was 5), and "ping ok" is 2 bytes (was 8).
+
+    Reading a frame doesn't allocate: next_frame() points inside the
+    buffer, and reader hands out the fields in place.
+*/
+namespace binary_protocol {
+
+enum { handshake = 0xB1 };
+
+enum opcode {
+    // client -> server
+    login = 1,              // name
+    ping = 2,
+    ask_clients = 3,
+    ask_clients_since = 4,  // version
+    stats = 5,
+    // server -> client
+    login_ok = 0x81,
+    ping_ok = 0x82,
+    ping_changed = 0x83,    // "ping client_list_changed"
+    clients = 0x84,         // count, names
+    clients_at = 0x85,      // version, count, names
+    clients_since = 0x86,   // version, count, (1 = came / 0 = left, name)...
+    stats_answer = 0x87     // text, as in the text protocol ("accepted 3 active 2 ...")
+};
+
+// the same request in the text protocol
+inline text_protocol::command to_command(opcode op) {
+    switch ( op) {
+    case login:             return text_protocol::login;
+    case ping:              return text_protocol::ping;
+    case ask_clients:       return text_protocol::ask_clients;
+    case ask_clients_since: return text_protocol::ask_clients_since;
+    case stats:             return text_protocol::stats;
+    default:                return text_protocol::unknown;
+    }
+}
+
+inline void put_varint(std::string & out, size_t value) {
+    while ( value >= 0x80) {
+        out += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+inline void put_string(std::string & out, const std::string & str) {
+    put_varint(out, str.size());
+    out += str;
+}
+
+// builds a frame: start it, add the fields to it, then finish it
+class writer {
+public:
+    explicit writer(opcode op) { body_ += static_cast<char>(op); }
+    writer & varint(size_t value) { put_varint(body_, value); return *this; }
+    writer & string(const std::string & str) { put_string(body_, str); return *this; }
+    writer & byte(unsigned char b) { body_ += static_cast<char>(b); return *this; }
+    std::string frame() const {
+        std::string out;
+        put_varint(out, body_.size());
+        return out + body_;
+    }
+private:
+    std::string body_;
+};
+// a frame without fields
+inline std::string frame(opcode op) { return writer(op).frame(); }
+
+// reads the fields of a frame, in place
+class reader {
+public:
+    reader(const char * data, size_t size) : cur_(data), end_(data + size) {}
+    bool varint(size_t & value) {
+        value = 0;
+        for ( unsigned shift = 0; cur_ < end_ && shift < sizeof(size_t) * 8; shift += 7) {
+            unsigned char b = *cur_++;
+            value |= static_cast<size_t>(b & 0x7F) << shift;
+            if ( !(b & 0x80)) return true;
+        }
+        return false;
+    }
+    bool string(const char *& str, size_t & len) {
+        if ( !varint(len) || len > size_t(end_ - cur_)) return false;
+        str = cur_;
+        cur_ += len;
+        return true;
+    }
+    bool byte(unsigned char & b) {
+        if ( cur_ == end_) return false;
+        b = *cur_++;
+        return true;
+    }
+    bool done() const { return cur_ == end_; }
+    const char * pos() const { return cur_; }
+private:
+    const char * cur_, * end_;
+};
+
+struct frame_view {
+    opcode op;
+    const char * data; // the fields
+    size_t size;
+};
+enum frame_result { frame_ok, frame_partial, frame_invalid };
+
+// the first frame in buff, without consuming it
+// (a frame that can't fit in buff is invalid)
+inline frame_result peek_frame(const line_buffer & buff, frame_view & f) {
+    reader header(buff.data(), buff.size());
+    size_t len = 0;
+    if ( !header.varint(len))
+        // the length is at most 10 bytes
+        return buff.size() < 10 ? frame_partial : frame_invalid;
+    const char * body = header.pos();
+    if ( len == 0 || len + (body - buff.data()) > buff.capacity()) return frame_invalid;
+    if ( len > size_t(buff.data() + buff.size() - body)) return frame_partial;
+    f.op = static_cast<opcode>(static_cast<unsigned char>(body[0]));
+    f.data = body + 1;
+    f.size = len - 1;
+    return frame_ok;
+}
+inline bool has_frame(const line_buffer & buff) {
+    frame_view f;
+    return peek_frame(buff, f) == frame_ok;
+}
+// next complete frame in buff - valid until the next buff.prepare()
+inline frame_result next_frame(line_buffer & buff, frame_view & f) {
+    frame_result result = peek_frame(buff, f);
+    if ( result == frame_ok) buff.consume(f.data + f.size - buff.data());
+    return result;
+}
+
+}
+
+#endif
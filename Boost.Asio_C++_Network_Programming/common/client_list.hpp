@@ -0,0 +1,165 @@
+#ifndef COMMON_CLIENT_LIST_HPP
+#define COMMON_CLIENT_LIST_HPP
+
+#include <deque>
+#include <map>
+#include <sstream>
+#include <string>
+#include <boost/atomic.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include "binary_protocol.hpp"
+
+/** the logged in clients, kept ready for answering ask_clients:
+    - every login/logout bumps the version, and is remembered in a short
+      log of changes
+    - each login/logout publishes a new snapshot: the answers, and the log
+      as of that version; it's never modified afterwards, so everybody
+      shares it (by reference)
+    - readers never lock: version(), current() and delta() only load the
+      published snapshot / version - so on each ping a client can cheaply
+      find out whether the list changed, no matter how many clients are
+      connected
+    - delta() tells a client only who came and who left after the version
+      it already knows
+    - add() and remove() do lock (one writer at a time), and rebuild the
+      snapshot - a server that doesn't want its handlers to wait for that
+      calls them from a single owner (see async_server_multi_threaded.cpp)
+
+    Protocol (answers end in enter):
+    - "ask_clients"                -> "clients John James "
+    - "ask_clients_since <version>"
+        -> "clients_since <version> +Lucy -John " if we still have the log
+        -> "clients_at <version> James Lucy "     otherwise (the whole list)
+    The same answers exist in the binary protocol (binary_protocol.hpp).
+*/
+class client_list : boost::noncopyable {
+public:
+    struct change {
+        size_t version;
+        bool added;
+        std::string name;
+    };
+    struct snapshot {
+        size_t version;
+        std::string answer;     // "clients ..." - for ask_clients
+        std::string versioned;  // "clients_at <version> ..."
+        // the same, as binary frames
+        std::string binary;
+        std::string binary_versioned;
+        // the last changes, up to "version"; we can give deltas to clients
+        // that know at least log_start
+        std::deque<change> log;
+        size_t log_start;
+    };
+    typedef boost::shared_ptr<const snapshot> snapshot_ptr;
+
+    explicit client_list(size_t max_log = 1024)
+        : last_version_(0), version_(0), log_start_(0), max_log_(max_log) {
+        publish();
+    }
+
+    // id = the client's connection id; a second login renames the client
+    void add(size_t id, const std::string & name) {
+        boost::mutex::scoped_lock lk(cs_);
+        std::map<size_t,std::string>::iterator found = names_.find(id);
+        if ( found != names_.end()) {
+            if ( found->second == name) return;
+            log_change(false, found->second);
+            found->second = name;
+        } else
+            names_.insert( std::make_pair(id, name));
+        log_change(true, name);
+        publish();
+    }
+    void remove(size_t id) {
+        boost::mutex::scoped_lock lk(cs_);
+        std::map<size_t,std::string>::iterator found = names_.find(id);
+        if ( found == names_.end()) return;
+        log_change(false, found->second);
+        names_.erase(found);
+        publish();
+    }
+    size_t version() const { return version_.load(boost::memory_order_acquire); }
+
+    // at least as new as the version() we've read before
+    snapshot_ptr current() const { return boost::atomic_load(&snapshot_); }
+
+    // false if we don't remember that far back - answer with current() then
+    bool delta(size_t since, std::string & answer, bool binary = false) const {
+        snapshot_ptr s = current();
+        if ( since < s->log_start || since > s->version) return false;
+        std::deque<change>::const_iterator first = s->log.begin(), last = s->log.end();
+        while ( first != last && first->version <= since) ++first;
+        if ( binary) {
+            binary_protocol::writer w(binary_protocol::clients_since);
+            w.varint(s->version).varint(last - first);
+            for ( ; first != last; ++first)
+                w.byte(first->added ? 1 : 0).string(first->name);
+            answer = w.frame();
+            return true;
+        }
+        std::ostringstream out;
+        out << "clients_since " << s->version << " ";
+        for ( ; first != last; ++first)
+            out << (first->added ? '+' : '-') << first->name << " ";
+        out << "\n";
+        answer = out.str();
+        return true;
+    }
+private:
+    void log_change(bool added, const std::string & name) {
+        change c;
+        c.version = ++last_version_;
+        c.added = added;
+        c.name = name;
+        log_.push_back(c);
+        if ( log_.size() > max_log_) {
+            log_start_ = log_.front().version;
+            log_.pop_front();
+        }
+    }
+    // the snapshot first, then the version - whoever sees the new version
+    // finds its snapshot
+    void publish() {
+        std::string names;
+        binary_protocol::writer binary(binary_protocol::clients);
+        binary_protocol::writer binary_versioned(binary_protocol::clients_at);
+        binary.varint(names_.size());
+        binary_versioned.varint(last_version_).varint(names_.size());
+        for ( std::map<size_t,std::string>::const_iterator b = names_.begin(), e = names_.end(); b != e; ++b) {
+            names += b->second + " ";
+            binary.string(b->second);
+            binary_versioned.string(b->second);
+        }
+        boost::shared_ptr<snapshot> s = boost::make_shared<snapshot>();
+        s->version = last_version_;
+        s->answer = "clients " + names + "\n";
+        std::ostringstream out;
+        out << "clients_at " << last_version_ << " " << names << "\n";
+        s->versioned = out.str();
+        s->binary = binary.frame();
+        s->binary_versioned = binary_versioned.frame();
+        s->log = log_;
+        s->log_start = log_start_;
+        boost::atomic_store(&snapshot_, snapshot_ptr(s));
+        version_.store(last_version_, boost::memory_order_release);
+    }
+private:
+    // the writers' lock - add() and remove() only
+    boost::mutex cs_;
+    // by connection id, so the list is in the order clients connected
+    std::map<size_t,std::string> names_;
+    size_t last_version_;
+    // the published version - only stored by publish()
+    boost::atomic<size_t> version_;
+    std::deque<change> log_;
+    size_t log_start_;
+    size_t max_log_;
+    // replaced with atomic_store(), so readers can load it without a lock
+    snapshot_ptr snapshot_;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef COMMON_CLIENT_REGISTRY_HPP
+#define COMMON_CLIENT_REGISTRY_HPP
+
+#include <algorithm>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+/** every client derives from this - it remembers where the registry keeps
+    it, so removing the client doesn't need a search
+*/
+class registry_hook {
+public:
+    registry_hook() : id_(0), shard_(0), index_(0), linked_(false) {}
+    // unique per registered connection, also decides the shard
+    size_t connection_id() const { return id_; }
+private:
+    template<class T> friend class client_registry;
+    size_t id_, shard_, index_;
+    bool linked_;
+};
+
+/** the set of connected clients, split in shards by connection id:
+    - add() and remove() are O(1) and lock only one shard
+      (remove moves the shard's last client into the freed slot)
+    - for_each() visits one shard at a time, and calls you on a copy
+      of that shard, with no lock held - so you can call into the client,
+      or even remove it, from within the callback
+    - the copy goes into a vector each thread keeps for the next call, so
+      once it's grown, for_each() doesn't allocate (it's meant to be called
+      often - say, every ms); don't call for_each() from the callback
+
+    T must derive from registry_hook.
+*/
+template<class T> class client_registry : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<T> ptr;
+
+    explicit client_registry(size_t shard_count = 64)
+        : shard_count_(shard_count > 0 ? shard_count : 1)
+        , shards_(new shard[shard_count_]), next_id_(1), size_(0) {}
+
+    void add(const ptr & client) {
+        registry_hook & h = *client;
+        h.id_ = next_id_++;
+        h.shard_ = h.id_ % shard_count_;
+        shard & s = shards_[h.shard_];
+        boost::mutex::scoped_lock lk(s.cs);
+        h.index_ = s.clients.size();
+        h.linked_ = true;
+        s.clients.push_back(client);
+        ++size_;
+    }
+    // does nothing if the client is not (or no longer) registered
+    void remove(T & client) {
+        registry_hook & h = client;
+        shard & s = shards_[h.shard_];
+        ptr last;
+        boost::mutex::scoped_lock lk(s.cs);
+        if ( !h.linked_) return;
+        h.linked_ = false;
+        size_t idx = h.index_;
+        // the last one fills the hole; the removed client is released
+        // only after we unlock (its destructor could take other locks)
+        last = s.clients.back();
+        s.clients.pop_back();
+        if ( idx < s.clients.size()) {
+            registry_hook & moved = *last;
+            moved.index_ = idx;
+            std::swap(s.clients[idx], last);
+        }
+        --size_;
+    }
+    void remove(const ptr & client) { remove(*client); }
+
+    size_t size() const { return size_; }
+
+    template<class F> void for_each(F f) const {
+        std::vector<ptr> * scratch = scratch_.get();
+        if ( !scratch) {
+            scratch = new std::vector<ptr>;
+            scratch_.reset(scratch);
+        }
+        std::vector<ptr> & copy = *scratch;
+        for ( size_t i = 0; i < shard_count_; ++i) {
+            { boost::mutex::scoped_lock lk(shards_[i].cs);
+              copy.assign(shards_[i].clients.begin(), shards_[i].clients.end());
+            }
+            for ( typename std::vector<ptr>::const_iterator b = copy.begin(), e = copy.end(); b != e; ++b)
+                f(*b);
+            // keeps the capacity, doesn't keep the clients alive
+            copy.clear();
+        }
+    }
+private:
+    struct shard {
+        mutable boost::mutex cs;
+        std::vector<ptr> clients;
+    };
+    size_t shard_count_;
+    boost::scoped_array<shard> shards_;
+    boost::atomic<size_t> next_id_;
+    boost::atomic<size_t> size_;
+    // for_each()'s copy of a shard, per thread
+    mutable boost::thread_specific_ptr< std::vector<ptr> > scratch_;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef COMMON_HANDLER_ALLOCATOR_HPP
+#define COMMON_HANDLER_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <new>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+/** memory for a connection's async operations, so they don't hit malloc:
+    - for every async_read/async_write/async_wait, asio allocates the
+      operation (and the handler bound into it); with the handler wrapped
+      by make_custom_alloc_handler(), asio asks us for that memory instead
+    - each connection owns a few small slots that are reused operation
+      after operation - a connection only has a couple of operations in
+      flight at a time (a read, a write)
+    - if the slots are taken or too small, we fall back to the heap, and
+      count it - heap_allocations() should stay flat once a connection
+      is up and running
+*/
+class handler_allocator : boost::noncopyable {
+public:
+    handler_allocator() {
+        for ( int i = 0; i < slot_count; ++i) in_use_[i] = false;
+    }
+    void * allocate(std::size_t size) {
+        if ( size <= slot_size)
+            for ( int i = 0; i < slot_count; ++i)
+                if ( !in_use_[i].exchange(true, boost::memory_order_acquire))
+                    return &slots_[i];
+        ++heap_allocations_();
+        return ::operator new(size);
+    }
+    void deallocate(void * p) {
+        for ( int i = 0; i < slot_count; ++i)
+            if ( p == &slots_[i]) {
+                in_use_[i].store(false, boost::memory_order_release);
+                return;
+            }
+        ::operator delete(p);
+    }
+    // all allocators, since the program started
+    static std::size_t heap_allocations() { return heap_allocations_(); }
+private:
+    static boost::atomic<std::size_t> & heap_allocations_() {
+        static boost::atomic<std::size_t> count(0);
+        return count;
+    }
+private:
+    enum { slot_count = 3, slot_size = 512 };
+    // aligned for anything asio puts in there
+    union slot {
+        char data[slot_size];
+        long double align_ld;
+        void * align_ptr;
+        long long align_ll;
+    };
+    slot slots_[slot_count];
+    boost::atomic<bool> in_use_[slot_count];
+};
+
+// a handler that allocates its memory from a handler_allocator
+template<class Handler> class custom_alloc_handler {
+public:
+    custom_alloc_handler(handler_allocator & a, Handler h) : allocator_(&a), handler_(h) {}
+
+    void operator()() { handler_(); }
+    template<class Arg1> void operator()(const Arg1 & arg1) { handler_(arg1); }
+    template<class Arg1, class Arg2> void operator()(const Arg1 & arg1, const Arg2 & arg2) {
+        handler_(arg1, arg2);
+    }
+
+    // the hooks asio calls (found by argument dependent lookup)
+    friend void * asio_handler_allocate(std::size_t size, custom_alloc_handler * this_handler) {
+        return this_handler->allocator_->allocate(size);
+    }
+    friend void asio_handler_deallocate(void * p, std::size_t, custom_alloc_handler * this_handler) {
+        this_handler->allocator_->deallocate(p);
+    }
+private:
+    handler_allocator * allocator_;
+    Handler handler_;
+};
+
+template<class Handler> inline custom_alloc_handler<Handler>
+make_custom_alloc_handler(handler_allocator & a, Handler h) {
+    return custom_alloc_handler<Handler>(a, h);
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef COMMON_IO_SERVICE_POOL_HPP
+#define COMMON_IO_SERVICE_POOL_HPP
+
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/** one io_service per thread (by default, one per core):
+    - each loop is run by exactly one thread, optionally pinned to a CPU
+    - a connection lives on one loop, so all its handlers run on one thread
+    - new connections go to the next loop (round_robin) or to the loop
+      that has the fewest connections (least_loaded)
+*/
+class io_service_pool : boost::noncopyable {
+public:
+    typedef boost::asio::io_service io_service;
+    enum policy_type { round_robin, least_loaded };
+
+    // loop_count = 0 means one loop per core
+    explicit io_service_pool(size_t loop_count = 0, bool pin = true,
+                             policy_type policy = round_robin)
+        : pin_(pin), policy_(policy), next_(0) {
+        if ( loop_count == 0) loop_count = cpu_count();
+        for ( size_t i = 0; i < loop_count; ++i)
+            loops_.push_back( loop_ptr(new loop));
+    }
+    ~io_service_pool() {
+        stop();
+        join();
+    }
+
+    size_t size() const { return loops_.size(); }
+    io_service & service(size_t idx) { return loops_[idx]->service; }
+
+    // picks the loop for a new connection - call release() once it's gone
+    size_t acquire() {
+        size_t idx = 0;
+        if ( policy_ == round_robin)
+            idx = next_++ % loops_.size();
+        else
+            for ( size_t i = 1; i < loops_.size(); ++i)
+                if ( loops_[i]->connections < loops_[idx]->connections)
+                    idx = i;
+        ++loops_[idx]->connections;
+        return idx;
+    }
+    // the connection is on that loop already (it was accepted there)
+    void acquire_on(size_t idx) { ++loops_[idx]->connections; }
+    void release(size_t idx) { --loops_[idx]->connections; }
+    size_t connections(size_t idx) const { return loops_[idx]->connections; }
+
+    void start() {
+        for ( size_t i = 0; i < loops_.size(); ++i) {
+            loops_[i]->work.reset( new io_service::work(loops_[i]->service));
+            threads_.create_thread( boost::bind(&io_service_pool::run_loop, this, i));
+        }
+    }
+    void stop() {
+        for ( size_t i = 0; i < loops_.size(); ++i) {
+            loops_[i]->work.reset();
+            loops_[i]->service.stop();
+        }
+    }
+    void join() { threads_.join_all(); }
+
+    static size_t cpu_count() {
+        size_t count = boost::thread::hardware_concurrency();
+        return count > 0 ? count : 1;
+    }
+private:
+    void run_loop(size_t idx) {
+        if ( pin_) pin_to_cpu(idx % cpu_count());
+        loops_[idx]->service.run();
+    }
+    static void pin_to_cpu(size_t cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)cpu; // pinning is only implemented on Linux
+#endif
+    }
+private:
+    struct loop {
+        loop() : connections(0) {}
+        io_service service;
+        boost::scoped_ptr<io_service::work> work;
+        boost::atomic<size_t> connections;
+    };
+    typedef boost::shared_ptr<loop> loop_ptr;
+    std::vector<loop_ptr> loops_;
+    boost::thread_group threads_;
+    bool pin_;
+    policy_type policy_;
+    boost::atomic<size_t> next_;
+};
+
+#endif
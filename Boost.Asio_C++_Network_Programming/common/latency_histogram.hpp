@@ -0,0 +1,94 @@
+#ifndef COMMON_LATENCY_HISTOGRAM_HPP
+#define COMMON_LATENCY_HISTOGRAM_HPP
+
+#include <vector>
+#include <boost/cstdint.hpp>
+
+/** latencies (in microseconds), HDR histogram style:
+    - below 128us, one bucket per microsecond
+    - above, each power of 2 is split in 64 buckets - so any value is
+      known within 1.6%, from microseconds to days, in ~2300 counters
+    - record() is O(1) and never allocates; histograms can be merged
+      (say, one per thread, merged when reporting)
+*/
+class latency_histogram {
+public:
+    typedef boost::uint64_t value_type;
+    enum { linear = 128, sub_bits = 6, sub_count = 1 << sub_bits, max_shift = 40,
+           bucket_count = linear + max_shift * sub_count };
+
+    latency_histogram() : counts_(bucket_count, 0) { reset(); }
+
+    void record(value_type us) {
+        ++counts_[index(us)];
+        ++count_;
+        sum_ += us;
+        if ( us < min_) min_ = us;
+        if ( us > max_) max_ = us;
+    }
+    void merge(const latency_histogram & other) {
+        for ( size_t i = 0; i < counts_.size(); ++i) counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        if ( other.min_ < min_) min_ = other.min_;
+        if ( other.max_ > max_) max_ = other.max_;
+    }
+    // for counts kept somewhere else (say, in atomics only one thread
+    // writes): the bucket a value goes into, and adding them back
+    static size_t bucket(value_type us) { return index(us); }
+    void add_bucket(size_t idx, value_type n) {
+        counts_[idx] += n;
+        count_ += n;
+    }
+    void add_totals(value_type sum, value_type min, value_type max) {
+        sum_ += sum;
+        if ( min < min_) min_ = min;
+        if ( max > max_) max_ = max;
+    }
+    void reset() {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = sum_ = max_ = 0;
+        min_ = value_type(-1);
+    }
+
+    value_type count() const { return count_; }
+    value_type min() const { return count_ ? min_ : 0; }
+    value_type max() const { return max_; }
+    double mean() const { return count_ ? double(sum_) / count_ : 0; }
+    // p in [0, 100]; the upper end of the bucket it falls in
+    value_type percentile(double p) const {
+        if ( count_ == 0) return 0;
+        value_type wanted = value_type(p / 100 * count_ + 0.5);
+        if ( wanted < 1) wanted = 1;
+        value_type seen = 0;
+        for ( size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if ( seen >= wanted) {
+                value_type upper = highest(i);
+                return upper < max_ ? upper : max_;
+            }
+        }
+        return max_;
+    }
+private:
+    static size_t index(value_type v) {
+        if ( v < linear) return size_t(v);
+        int msb = 63;
+        while ( !(v >> msb)) --msb;
+        int shift = msb - sub_bits;     // v >> shift is in [64, 128)
+        if ( shift > max_shift) return bucket_count - 1;
+        return linear + (shift - 1) * sub_count + size_t((v >> shift) - sub_count);
+    }
+    // the highest value that goes into bucket idx
+    static value_type highest(size_t idx) {
+        if ( idx < linear) return idx;
+        int shift = int((idx - linear) / sub_count) + 1;
+        value_type top = (idx - linear) % sub_count + sub_count;
+        return ((top + 1) << shift) - 1;
+    }
+private:
+    std::vector<value_type> counts_;
+    value_type count_, sum_, min_, max_;
+};
+
+#endif
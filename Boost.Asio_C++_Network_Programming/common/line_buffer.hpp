@@ -0,0 +1,88 @@
+#ifndef COMMON_LINE_BUFFER_HPP
+#define COMMON_LINE_BUFFER_HPP
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+
+/** framing for '\n'-terminated text messages, shared by clients and servers:
+    - we read in big chunks (read_some into prepare()), not one-by-one
+    - next_line() hands out every complete message already buffered, so
+      several pipelined requests are dispatched after a single read
+    - whatever follows the last enter stays buffered for the next read
+
+    The search for enter is memchr(), which glibc implements with SSE2/AVX2,
+    and we never re-scan bytes that were already found not to contain it.
+
+    Note: a line returned by next_line() points inside the buffer - it's
+    valid until the next prepare().
+*/
+class line_buffer {
+public:
+    enum { default_max_line = 1024, default_chunk = 8192 };
+
+    explicit line_buffer(size_t max_line = default_max_line,
+                         size_t chunk = default_chunk)
+        : buff_(chunk > max_line ? chunk : max_line + 1)
+        , begin_(0), end_(0), scanned_(0), max_line_(max_line) {}
+
+    // free space for the next read; makes room by dropping consumed bytes
+    boost::asio::mutable_buffers_1 prepare() {
+        if ( begin_ == end_)
+            begin_ = end_ = scanned_ = 0;
+        else if ( buff_.size() - end_ < buff_.size() / 4)
+            compact();
+        return boost::asio::buffer(&buff_[0] + end_, buff_.size() - end_);
+    }
+    void commit(size_t bytes) { end_ += bytes; }
+
+    // next complete message, without its enter
+    bool next_line(const char *& line, size_t & len) {
+        const char * data = &buff_[0];
+        const char * enter = static_cast<const char*>(
+            std::memchr(data + scanned_, '\n', end_ - scanned_));
+        if ( !enter) {
+            scanned_ = end_;
+            return false;
+        }
+        line = data + begin_;
+        len = enter - line;
+        begin_ = scanned_ = enter - data + 1;
+        return true;
+    }
+    bool next_line(std::string & line) {
+        const char * b; size_t len;
+        if ( !next_line(b, len)) return false;
+        line.assign(b, len);
+        return true;
+    }
+    bool has_line() const {
+        return std::memchr(&buff_[0] + scanned_, '\n', end_ - scanned_) != 0;
+    }
+    // the other party sent more than max_line bytes without an enter
+    bool overflow() const { return end_ - begin_ > max_line_ && !has_line(); }
+    // bytes received but not yet handed out - for other kinds of framing
+    // (see binary_protocol.hpp), use data() + size(), then consume()
+    const char * data() const { return &buff_[0] + begin_; }
+    size_t size() const { return end_ - begin_; }
+    void consume(size_t bytes) {
+        begin_ += bytes;
+        if ( scanned_ < begin_) scanned_ = begin_;
+    }
+    size_t capacity() const { return buff_.size(); }
+    void clear() { begin_ = end_ = scanned_ = 0; }
+private:
+    void compact() {
+        std::memmove(&buff_[0], &buff_[0] + begin_, end_ - begin_);
+        end_ -= begin_;
+        scanned_ -= begin_;
+        begin_ = 0;
+    }
+private:
+    std::vector<char> buff_;
+    size_t begin_, end_, scanned_;
+    size_t max_line_;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef COMMON_OBJECT_POOL_HPP
+#define COMMON_OBJECT_POOL_HPP
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** reuses objects (connections) instead of creating and destroying them:
+    - acquire() hands out a shared_ptr to a free object; once the last
+      copy of it is gone, the object goes back to the pool - it's reset(),
+      not destroyed, so its socket, buffers etc. are reused
+    - the shared_ptr control blocks are recycled as well, so in the
+      steady state acquire() doesn't allocate at all
+    - warm_up objects are created up front; when we run out, we create
+      grow_by more at once
+    - the objects live as long as the pool (make it global)
+
+    T must have a reset() - called when the object comes back, to make
+    it as good as new. It can use enable_shared_from_this.
+*/
+template<class T> class object_pool : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<T> ptr;
+    typedef boost::function<T* ()> factory;
+
+    object_pool(factory create, size_t warm_up = 0, size_t grow_by = 16)
+        : create_(create), grow_by_(grow_by > 0 ? grow_by : 1), count_(0) {
+        boost::mutex::scoped_lock lk(cs_);
+        grow(warm_up);
+    }
+    ~object_pool() {
+        for ( size_t i = 0; i < free_.size(); ++i) delete free_[i];
+    }
+
+    ptr acquire() {
+        T * obj;
+        { boost::mutex::scoped_lock lk(cs_);
+          if ( free_.empty()) grow(grow_by_);
+          obj = free_.back();
+          free_.pop_back();
+        }
+        return ptr(obj, recycler(*this), block_allocator<T>(blocks_));
+    }
+    // objects created so far / waiting to be handed out
+    size_t size() const { boost::mutex::scoped_lock lk(cs_); return count_; }
+    size_t available() const { boost::mutex::scoped_lock lk(cs_); return free_.size(); }
+private:
+    void grow(size_t count) {
+        for ( size_t i = 0; i < count; ++i)
+            free_.push_back( create_());
+        count_ += count;
+    }
+    void release(T * obj) {
+        obj->reset();
+        boost::mutex::scoped_lock lk(cs_);
+        free_.push_back(obj);
+    }
+
+    // the shared_ptr deleter: gives the object back
+    struct recycler {
+        explicit recycler(object_pool & pool) : pool_(&pool) {}
+        void operator()(T * obj) const { pool_->release(obj); }
+        object_pool * pool_;
+    };
+
+    // memory for the control blocks - they're all the same size
+    class block_cache : boost::noncopyable {
+    public:
+        block_cache() : size_(0) {}
+        ~block_cache() {
+            for ( size_t i = 0; i < free_.size(); ++i) ::operator delete(free_[i]);
+        }
+        void * allocate(size_t size) {
+            { boost::mutex::scoped_lock lk(cs_);
+              if ( size == size_ && !free_.empty()) {
+                  void * p = free_.back();
+                  free_.pop_back();
+                  return p;
+              }
+              if ( size_ == 0) size_ = size;
+            }
+            return ::operator new(size);
+        }
+        void deallocate(void * p, size_t size) {
+            boost::mutex::scoped_lock lk(cs_);
+            if ( size == size_) free_.push_back(p);
+            else ::operator delete(p);
+        }
+    private:
+        boost::mutex cs_;
+        size_t size_;
+        std::vector<void*> free_;
+    };
+    template<class U> class block_allocator {
+    public:
+        typedef U value_type;
+        typedef U * pointer;
+        typedef const U * const_pointer;
+        typedef U & reference;
+        typedef const U & const_reference;
+        typedef std::size_t size_type;
+        typedef std::ptrdiff_t difference_type;
+        template<class V> struct rebind { typedef block_allocator<V> other; };
+
+        explicit block_allocator(block_cache & cache) : cache_(&cache) {}
+        template<class V> block_allocator(const block_allocator<V> & other) : cache_(other.cache_) {}
+
+        pointer allocate(size_type n, const void * = 0) {
+            return static_cast<pointer>(cache_->allocate(n * sizeof(U)));
+        }
+        void deallocate(pointer p, size_type n) { cache_->deallocate(p, n * sizeof(U)); }
+        void construct(pointer p, const U & val) { new (p) U(val); }
+        void destroy(pointer p) { p->~U(); }
+        size_type max_size() const { return size_type(-1) / sizeof(U); }
+        bool operator==(const block_allocator & other) const { return cache_ == other.cache_; }
+        bool operator!=(const block_allocator & other) const { return cache_ != other.cache_; }
+
+        block_cache * cache_;
+    };
+private:
+    factory create_;
+    size_t grow_by_;
+    mutable boost::mutex cs_;
+    std::vector<T*> free_;
+    size_t count_;
+    block_cache blocks_;
+};
+
+#endif
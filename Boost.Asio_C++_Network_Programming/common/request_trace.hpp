@@ -0,0 +1,225 @@
+#ifndef COMMON_REQUEST_TRACE_HPP
+#define COMMON_REQUEST_TRACE_HPP
+
+#include <iomanip>
+#include <ostream>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include "latency_histogram.hpp"
+
+/** where the time of a request goes, stage by stage:
+    - the connection takes a timestamp when its read handler runs, when
+      the handlers of the messages are done, and when the answer is
+      written - see timestamps
+    - every request feeds one histogram per stage (one set per thread,
+      written by that thread only - see stage_histograms)
+    - the slow ones also go to a flight recorder: a ring of the last
+      ring_size slow requests, that writers fill without a lock
+    - dump() prints both - call it on a signal
+
+    Off by default: then a connection only checks enabled() (one relaxed
+    load) per read.
+
+    A "request" is everything one read brought in - with pipelining, that
+    can be several messages (see requests).
+*/
+namespace request_trace {
+
+typedef boost::chrono::steady_clock clock_type;
+typedef boost::uint64_t value_type;
+
+enum stage { dispatch, write, total, stage_count };
+inline const char * stage_name(int s) {
+    static const char * names[stage_count] = { "dispatch", "write", "total" };
+    return names[s];
+}
+
+struct timestamps {
+    clock_type::time_point read, handled, written;
+};
+
+inline value_type micros(clock_type::duration d) {
+    return boost::chrono::duration_cast<boost::chrono::microseconds>(d).count();
+}
+
+/** the last ring_size slow requests:
+    - a writer takes the next slot with one fetch_add, then fills it in;
+      its sequence number is odd while it's being written
+    - a reader skips the slots whose sequence is odd or changed while
+      it copied them (it's being overwritten - the ring went all around)
+*/
+class flight_recorder : boost::noncopyable {
+public:
+    enum { ring_size = 1024 };
+    struct record {
+        value_type at;                  // micros since the recorder started
+        value_type stages[stage_count]; // micros
+        value_type connection, requests;
+    };
+
+    flight_recorder() : next_(0), start_(clock_type::now()) {
+        for ( int i = 0; i < ring_size; ++i) slots_[i].sequence = 0;
+    }
+    void add(const timestamps & t, const value_type * stages, size_t connection, size_t requests) {
+        value_type idx = next_.fetch_add(1, boost::memory_order_relaxed);
+        slot & s = slots_[idx % ring_size];
+        s.sequence.store(2 * idx + 1, boost::memory_order_relaxed);
+        boost::atomic_thread_fence(boost::memory_order_release);
+        s.fields[0].store(micros(t.read - start_), boost::memory_order_relaxed);
+        for ( int i = 0; i < stage_count; ++i)
+            s.fields[1 + i].store(stages[i], boost::memory_order_relaxed);
+        s.fields[1 + stage_count].store(connection, boost::memory_order_relaxed);
+        s.fields[2 + stage_count].store(requests, boost::memory_order_relaxed);
+        s.sequence.store(2 * idx + 2, boost::memory_order_release);
+    }
+    // the complete records, oldest first
+    std::vector<record> records() const {
+        std::vector<record> result;
+        value_type end = next_.load(boost::memory_order_acquire);
+        value_type begin = end > ring_size ? end - ring_size : 0;
+        for ( value_type idx = begin; idx < end; ++idx) {
+            const slot & s = slots_[idx % ring_size];
+            value_type before = s.sequence.load(boost::memory_order_acquire);
+            if ( before != 2 * idx + 2) continue;
+            record r;
+            r.at = s.fields[0].load(boost::memory_order_relaxed);
+            for ( int i = 0; i < stage_count; ++i)
+                r.stages[i] = s.fields[1 + i].load(boost::memory_order_relaxed);
+            r.connection = s.fields[1 + stage_count].load(boost::memory_order_relaxed);
+            r.requests = s.fields[2 + stage_count].load(boost::memory_order_relaxed);
+            boost::atomic_thread_fence(boost::memory_order_acquire);
+            if ( s.sequence.load(boost::memory_order_relaxed) == before) result.push_back(r);
+        }
+        return result;
+    }
+private:
+    struct slot {
+        boost::atomic<value_type> sequence;
+        boost::atomic<value_type> fields[3 + stage_count];
+    };
+    slot slots_[ring_size];
+    boost::atomic<value_type> next_;
+    clock_type::time_point start_;
+};
+
+/** the histograms of one thread: only that thread writes them, so an
+    update is a relaxed load + store, like server_stats - no lock. dump()
+    reads them as they're written: a stage may be a request behind.
+*/
+class stage_histograms : boost::noncopyable {
+public:
+    stage_histograms() {
+        for ( int s = 0; s < stage_count; ++s) {
+            for ( int i = 0; i < latency_histogram::bucket_count; ++i)
+                counts_[s][i].store(0, boost::memory_order_relaxed);
+            sums_[s].store(0, boost::memory_order_relaxed);
+            mins_[s].store(value_type(-1), boost::memory_order_relaxed);
+            maxes_[s].store(0, boost::memory_order_relaxed);
+        }
+    }
+    void record(int s, value_type us) {
+        bump(counts_[s][latency_histogram::bucket(us)], 1);
+        bump(sums_[s], us);
+        if ( us < mins_[s].load(boost::memory_order_relaxed)) mins_[s].store(us, boost::memory_order_relaxed);
+        if ( us > maxes_[s].load(boost::memory_order_relaxed)) maxes_[s].store(us, boost::memory_order_relaxed);
+    }
+    // adds stage s to "into"
+    void read(int s, latency_histogram & into) const {
+        for ( int i = 0; i < latency_histogram::bucket_count; ++i) {
+            value_type n = counts_[s][i].load(boost::memory_order_relaxed);
+            if ( n) into.add_bucket(i, n);
+        }
+        into.add_totals(sums_[s].load(boost::memory_order_relaxed), mins_[s].load(boost::memory_order_relaxed),
+                        maxes_[s].load(boost::memory_order_relaxed));
+    }
+private:
+    static void bump(boost::atomic<value_type> & v, value_type n) {
+        v.store( v.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+    }
+    boost::atomic<value_type> counts_[stage_count][latency_histogram::bucket_count];
+    boost::atomic<value_type> sums_[stage_count], mins_[stage_count], maxes_[stage_count];
+};
+
+class tracer : boost::noncopyable {
+public:
+    static tracer & instance() {
+        static tracer t;
+        return t;
+    }
+    // requests slower than slow_micros (in total) go to the flight recorder
+    void enable(value_type slow_micros) {
+        slow_micros_ = slow_micros;
+        enabled_.store(true, boost::memory_order_relaxed);
+    }
+    bool enabled() const { return enabled_.load(boost::memory_order_relaxed); }
+
+    void add(const timestamps & t, size_t connection, size_t requests) {
+        value_type stages[stage_count];
+        stages[dispatch] = micros(t.handled - t.read);
+        stages[write] = micros(t.written - t.handled);
+        stages[total] = micros(t.written - t.read);
+        stage_histograms & h = local();
+        for ( int i = 0; i < stage_count; ++i) h.record(i, stages[i]);
+        if ( stages[total] >= slow_micros_) recorder_.add(t, stages, connection, requests);
+    }
+
+    void dump(std::ostream & out) const {
+        latency_histogram stages[stage_count];
+        { boost::mutex::scoped_lock lk(cs_);
+          for ( size_t b = 0; b < blocks_.size(); ++b)
+              for ( int i = 0; i < stage_count; ++i) blocks_[b]->read(i, stages[i]);
+        }
+        out << "stage            count      p50      p99    p99.9      max (us)\n";
+        for ( int i = 0; i < stage_count; ++i)
+            out << std::left << std::setw(10) << stage_name(i) << std::right
+                << std::setw(11) << stages[i].count() << std::setw(9) << stages[i].percentile(50)
+                << std::setw(9) << stages[i].percentile(99) << std::setw(9) << stages[i].percentile(99.9)
+                << std::setw(9) << stages[i].max() << "\n";
+        std::vector<flight_recorder::record> slow = recorder_.records();
+        out << "last " << slow.size() << " requests slower than " << slow_micros_ << " us:\n";
+        for ( size_t i = 0; i < slow.size(); ++i) {
+            const flight_recorder::record & r = slow[i];
+            out << "  at " << std::fixed << std::setprecision(3) << r.at / 1e6 << "s"
+                << " connection " << r.connection << " requests " << r.requests;
+            for ( int s = 0; s < stage_count; ++s) out << " " << stage_name(s) << " " << r.stages[s];
+            out << "\n";
+        }
+        out.flush();
+    }
+private:
+    // the histograms of the calling thread; the lock is only taken the
+    // first time a thread asks
+    stage_histograms & local() {
+        stage_histograms * h = local_.get();
+        if ( !h) {
+            h = new stage_histograms;
+            local_.reset(h);
+            boost::mutex::scoped_lock lk(cs_);
+            blocks_.push_back(h);
+        }
+        return *h;
+    }
+    // the histograms outlive their threads
+    static void keep(stage_histograms *) {}
+    tracer() : enabled_(false), slow_micros_(0), local_(keep) {}
+private:
+    boost::atomic<bool> enabled_;
+    value_type slow_micros_;
+    boost::thread_specific_ptr<stage_histograms> local_;
+    // the registered histograms - only locked to register and to dump
+    mutable boost::mutex cs_;
+    std::vector<stage_histograms*> blocks_;
+    flight_recorder recorder_;
+};
+
+inline bool enabled() { return tracer::instance().enabled(); }
+inline clock_type::time_point now() { return clock_type::now(); }
+
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef COMMON_RING_BUFFER_HPP
+#define COMMON_RING_BUFFER_HPP
+
+#include <algorithm>
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/asio/buffer.hpp>
+
+/** a fixed size byte ring, for streaming data from one socket to another:
+    - read (read_some) into prepare(), then commit() what you got
+    - write (write_some) from data(), then consume() what went out
+    - reading and writing can be in progress at the same time - they touch
+      different parts of the ring
+    - prepare() and data() are scatter/gather sequences of (at most) two
+      buffers, so we never need to move data to the front of the ring
+
+    Not thread safe - the reader and the writer must run on the same thread
+    (or strand).
+*/
+class ring_buffer {
+public:
+    typedef boost::array<boost::asio::mutable_buffer,2> mutable_buffers;
+    typedef boost::array<boost::asio::const_buffer,2> const_buffers;
+
+    explicit ring_buffer(size_t capacity) : buff_(capacity), start_(0), size_(0) {}
+
+    // the free space, up to the end of the ring, then from its start
+    mutable_buffers prepare() {
+        if ( size_ == 0) start_ = 0; // so the read is one contiguous buffer
+        size_t end = (start_ + size_) % buff_.size();
+        size_t free = buff_.size() - size_;
+        size_t first = std::min(free, buff_.size() - end);
+        mutable_buffers bufs = { {
+            boost::asio::buffer(&buff_[0] + end, first),
+            boost::asio::buffer(&buff_[0], free - first) } };
+        return bufs;
+    }
+    void commit(size_t bytes) { size_ += bytes; }
+
+    // the bytes not yet consumed, in order
+    const_buffers data() const {
+        size_t first = std::min(size_, buff_.size() - start_);
+        const_buffers bufs = { {
+            boost::asio::buffer(&buff_[0] + start_, first),
+            boost::asio::buffer(&buff_[0], size_ - first) } };
+        return bufs;
+    }
+    void consume(size_t bytes) {
+        start_ = (start_ + bytes) % buff_.size();
+        size_ -= bytes;
+    }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return buff_.size(); }
+    bool empty() const { return size_ == 0; }
+private:
+    std::vector<char> buff_;
+    size_t start_, size_;
+};
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef COMMON_SERVER_STATS_HPP
+#define COMMON_SERVER_STATS_HPP
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include "text_protocol.hpp"
+
+/** counters of a running server, cheap enough to leave on in production:
+    - each thread has its own block of counters, and only that thread
+      writes to it - so an update is a relaxed load + store: no lock, no
+      locked instruction, no cache line going back and forth between cores
+    - collect() adds up the blocks of all the threads; it only locks the
+      list of blocks (which changes when a thread counts for the first
+      time) - never the clients
+    - the sums aren't a consistent snapshot (a counter can move while we
+      add them up), which is fine for watching a server
+
+    Usage:
+        server_stats::count(server_stats::accepted);
+        server_stats::count_command(text_protocol::ping);
+        std::cout << server_stats::collect().text() << std::endl;
+*/
+namespace server_stats {
+
+typedef boost::int64_t value_type;
+
+enum counter_id {
+    accepted,       // connections
+    closed,         // connections gone - active = accepted - closed
+    timed_out,      // no ping in time (also counted in closed)
+    invalid,        // unknown commands, bad arguments, messages too long
+    bytes_in,
+    bytes_out,
+    queued_bytes,   // waiting in write queues, right now
+    queued_max,     // the longest write queue seen (the max of the threads)
+    first_command,  // then one per text_protocol::command
+    counter_count = first_command + text_protocol::unknown
+};
+
+class counters : boost::noncopyable {
+public:
+    counters() {
+        for ( int i = 0; i < counter_count; ++i) values_[i] = 0;
+    }
+    void add(counter_id id, value_type n = 1) {
+        values_[id].store( values_[id].load(boost::memory_order_relaxed) + n,
+                           boost::memory_order_relaxed);
+    }
+    void at_least(counter_id id, value_type n) {
+        if ( values_[id].load(boost::memory_order_relaxed) < n)
+            values_[id].store(n, boost::memory_order_relaxed);
+    }
+    value_type get(counter_id id) const { return values_[id].load(boost::memory_order_relaxed); }
+private:
+    boost::atomic<value_type> values_[counter_count];
+    // so that two threads' blocks never share a cache line
+    char pad_[64];
+};
+
+struct snapshot {
+    snapshot() {
+        for ( int i = 0; i < counter_count; ++i) values[i] = 0;
+    }
+    value_type operator[](counter_id id) const { return values[id]; }
+    value_type active() const { return values[accepted] - values[closed]; }
+    // "accepted 10 active 2 ... ping 120 ..."
+    std::string text() const {
+        std::ostringstream out;
+        out << "accepted " << values[accepted] << " active " << active()
+            << " timed_out " << values[timed_out] << " invalid " << values[invalid]
+            << " bytes_in " << values[bytes_in] << " bytes_out " << values[bytes_out]
+            << " write_queue " << values[queued_bytes] << " write_queue_max " << values[queued_max];
+        for ( int i = 0; i < text_protocol::unknown; ++i)
+            out << " " << text_protocol::commands[i].name << " " << values[first_command + i];
+        return out.str();
+    }
+    value_type values[counter_count];
+};
+
+class registry : boost::noncopyable {
+public:
+    static registry & instance() {
+        static registry r;
+        return r;
+    }
+    // the block of the calling thread
+    counters & local() {
+        counters * c = local_.get();
+        if ( !c) {
+            c = new counters;
+            local_.reset(c);
+            boost::mutex::scoped_lock lk(cs_);
+            blocks_.push_back(c);
+        }
+        return *c;
+    }
+    snapshot collect() const {
+        snapshot s;
+        boost::mutex::scoped_lock lk(cs_);
+        for ( size_t b = 0; b < blocks_.size(); ++b)
+            for ( int i = 0; i < counter_count; ++i) {
+                counter_id id = static_cast<counter_id>(i);
+                if ( id == queued_max) {
+                    if ( blocks_[b]->get(id) > s.values[i]) s.values[i] = blocks_[b]->get(id);
+                } else
+                    s.values[i] += blocks_[b]->get(id);
+            }
+        return s;
+    }
+private:
+    // the blocks outlive their threads - what they counted still counts
+    static void keep(counters *) {}
+    registry() : local_(keep) {}
+
+    boost::thread_specific_ptr<counters> local_;
+    mutable boost::mutex cs_;
+    std::vector<counters*> blocks_;
+};
+
+inline void count(counter_id id, value_type n = 1) { registry::instance().local().add(id, n); }
+inline void count_command(text_protocol::command c) {
+    if ( c == text_protocol::unknown) count(invalid);
+    else count( static_cast<counter_id>(first_command + c));
+}
+// a write queue is now "bytes" long
+inline void queue_depth(value_type bytes) { registry::instance().local().at_least(queued_max, bytes); }
+inline snapshot collect() { return registry::instance().collect(); }
+
+// prints the counters every "secs" seconds, from a thread of its own
+inline void dump_loop(int secs) {
+    while ( true) {
+        boost::this_thread::sleep( boost::posix_time::seconds(secs));
+        std::cout << "stats " << collect().text() << std::endl;
+    }
+}
+inline void dump_every(int secs) {
+    if ( secs > 0) boost::thread( boost::bind(dump_loop, secs)).detach();
+}
+
+}
+
+#endif
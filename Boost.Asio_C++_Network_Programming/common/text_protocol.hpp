@@ -0,0 +1,85 @@
+#ifndef COMMON_TEXT_PROTOCOL_HPP
+#define COMMON_TEXT_PROTOCOL_HPP
+
+#include <cstring>
+#include <boost/utility/string_ref.hpp>
+
+/** the requests of the text protocol: "<command> <args>", one per line
+
+    To add a command, add it to the list below - this generates both the
+    enum and the lookup table, then handle it in the server's switch.
+
+    parse() works on the line as it sits in the read buffer (string_ref
+    is just a pointer + length), so from the read to the handler nothing
+    is copied or allocated. The lookup compares the length first, and only
+    then the bytes - with a handful of commands, that's as fast as a hash.
+*/
+#define TEXT_PROTOCOL_COMMANDS(command) \
+    command(login,              "login") \
+    command(ping,               "ping") \
+    command(ask_clients,        "ask_clients") \
+    command(ask_clients_since,  "ask_clients_since") \
+    command(stats,              "stats")
+
+namespace text_protocol {
+
+typedef boost::string_ref string_ref;
+
+enum command {
+#define TEXT_PROTOCOL_ENUM(id, name) id,
+    TEXT_PROTOCOL_COMMANDS(TEXT_PROTOCOL_ENUM)
+#undef TEXT_PROTOCOL_ENUM
+    unknown
+};
+
+struct command_entry {
+    const char * name;
+    size_t len;
+    command id;
+};
+static const command_entry commands[] = {
+#define TEXT_PROTOCOL_ENTRY(id, name) { name, sizeof(name) - 1, id },
+    TEXT_PROTOCOL_COMMANDS(TEXT_PROTOCOL_ENTRY)
+#undef TEXT_PROTOCOL_ENTRY
+};
+
+inline command find_command(string_ref word) {
+    for ( size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i)
+        if ( commands[i].len == word.size()
+                && std::memcmp(commands[i].name, word.data(), word.size()) == 0)
+            return commands[i].id;
+    return unknown;
+}
+
+// the first word of "rest" (words are separated by spaces);
+// false if there's none
+inline bool next_word(string_ref & rest, string_ref & word) {
+    size_t begin = 0;
+    while ( begin < rest.size() && rest[begin] == ' ') ++begin;
+    size_t end = begin;
+    while ( end < rest.size() && rest[end] != ' ' && rest[end] != '\r') ++end;
+    word = rest.substr(begin, end - begin);
+    rest = rest.substr(end);
+    return !word.empty();
+}
+inline bool to_number(string_ref word, size_t & value) {
+    if ( word.empty()) return false;
+    value = 0;
+    for ( size_t i = 0; i < word.size(); ++i) {
+        if ( word[i] < '0' || word[i] > '9') return false;
+        value = value * 10 + (word[i] - '0');
+    }
+    return true;
+}
+
+// "ask_clients_since 12" -> ask_clients_since, args = " 12"
+inline command parse(string_ref line, string_ref & args) {
+    string_ref word;
+    args = line;
+    if ( !next_word(args, word)) return unknown;
+    return find_command(word);
+}
+
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef COMMON_TIMING_WHEEL_HPP
+#define COMMON_TIMING_WHEEL_HPP
+
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** idle timeouts for lots of clients, in O(1):
+    - arm() once the client connects, touch() whenever it talks to us,
+      disarm() when it's gone (stop)
+    - touch() only remembers the current tick, it never moves the client
+      inside the wheel. When the client's slot comes up, we look at when
+      it was last active - if it talked meanwhile, we put it back further
+    - two levels, like the Linux kernel timers: 256 slots of one tick,
+      then 64 slots of 256 ticks each, which cascade into the first level
+      as time passes
+    - the clock is read once per tick(); now() returns that cached tick
+    - everybody that timed out during a tick is handed to the callback
+      in one go, with no lock held
+
+    T must derive from timing_wheel<T>::entry and from
+    boost::enable_shared_from_this<T>.
+*/
+template<class T> class timing_wheel : boost::noncopyable {
+    struct link {
+        link() : prev(this), next(this) {}
+        bool linked() const { return next != this; }
+        void unlink() {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+        void push_back(link & l) {
+            l.prev = prev;
+            l.next = this;
+            prev->next = &l;
+            prev = &l;
+        }
+        link *prev, *next;
+    };
+public:
+    typedef boost::shared_ptr<T> ptr;
+    typedef boost::function<void (const std::vector<ptr> &)> expired_func;
+
+    class entry : private link {
+    public:
+        entry() : wheel_(0), expires_(0), last_active_(0) {}
+        ~entry() { if ( wheel_) wheel_->disarm(*this); }
+    private:
+        friend class timing_wheel;
+        // the wheel we were armed on; only arm() sets it (tick() and
+        // disarm() just unlink us, with the wheel's lock held), so reading
+        // it doesn't race with the wheel's thread
+        timing_wheel * wheel_;
+        size_t expires_;
+        boost::atomic<size_t> last_active_;
+    };
+
+    timing_wheel(size_t timeout_ms, size_t tick_ms, expired_func on_expired)
+        : tick_ms_(tick_ms), timeout_((timeout_ms + tick_ms - 1) / tick_ms)
+        , on_expired_(on_expired), current_(0)
+        , start_(boost::chrono::steady_clock::now()) {}
+
+    // the tick we're at - cached, doesn't read the clock
+    size_t now() const { return current_.load(boost::memory_order_relaxed); }
+
+    void arm(T & client) {
+        entry & e = client;
+        e.last_active_ = now();
+        e.wheel_ = this;
+        boost::mutex::scoped_lock lk(cs_);
+        e.unlink();
+        schedule(e, e.last_active_ + timeout_);
+    }
+    void touch(T & client) {
+        entry & e = client;
+        e.last_active_.store(now(), boost::memory_order_relaxed);
+    }
+    void disarm(T & client) { disarm( static_cast<entry&>(client)); }
+
+    // advances the wheel to the current time, and calls on_expired
+    // for everybody that's been idle for too long
+    void tick() {
+        using namespace boost::chrono;
+        size_t target = duration_cast<milliseconds>(steady_clock::now() - start_).count() / tick_ms_;
+        std::vector<ptr> expired;
+        { boost::mutex::scoped_lock lk(cs_);
+          while ( current_ < target)
+              advance(expired);
+        }
+        if ( !expired.empty())
+            on_expired_(expired);
+    }
+
+    // drive the wheel from an io_service: tick() every tick_ms
+    void start(boost::asio::io_service & service) {
+        timer_.reset( new boost::asio::deadline_timer(service));
+        schedule_tick();
+    }
+    void stop() {
+        if ( timer_) timer_->cancel();
+    }
+private:
+    enum { l0_bits = 8, l0_size = 1 << l0_bits, l0_mask = l0_size - 1,
+           l1_size = 64, l1_mask = l1_size - 1 };
+
+    void disarm(entry & e) {
+        boost::mutex::scoped_lock lk(cs_);
+        e.unlink();
+    }
+    void schedule(entry & e, size_t expires) {
+        size_t cur = current_;
+        if ( expires < cur) expires = cur;
+        size_t delta = expires - cur;
+        link * slot;
+        if ( delta < l0_size)
+            slot = &level0_[expires & l0_mask];
+        else {
+            // too far away - we'll look at it again when we get closer
+            if ( delta >= l0_size * (l1_size - 1))
+                expires = cur + l0_size * (l1_size - 1) - 1;
+            slot = &level1_[(expires >> l0_bits) & l1_mask];
+        }
+        e.expires_ = expires;
+        slot->push_back(e);
+    }
+    void advance(std::vector<ptr> & expired) {
+        size_t cur = ++current_;
+        if ( (cur & l0_mask) == 0)
+            // the next 256 ticks move from the 2nd level to the 1st
+            for ( link & slot = level1_[(cur >> l0_bits) & l1_mask]; slot.linked(); ) {
+                entry & e = static_cast<entry&>(*slot.next);
+                e.unlink();
+                schedule(e, e.expires_);
+            }
+        for ( link & slot = level0_[cur & l0_mask]; slot.linked(); ) {
+            entry & e = static_cast<entry&>(*slot.next);
+            e.unlink();
+            size_t deadline = e.last_active_ + timeout_;
+            if ( deadline > cur) {
+                schedule(e, deadline); // it talked to us meanwhile
+                continue;
+            }
+            // it could be just being destroyed
+            ptr client = static_cast<T&>(e).weak_from_this().lock();
+            if ( client) expired.push_back(client);
+        }
+    }
+
+    void schedule_tick() {
+        timer_->expires_from_now(boost::posix_time::millisec(tick_ms_));
+        timer_->async_wait( boost::bind(&timing_wheel::on_tick, this, _1));
+    }
+    void on_tick(const boost::system::error_code & err) {
+        if ( err) return;
+        tick();
+        schedule_tick();
+    }
+private:
+    size_t tick_ms_;
+    size_t timeout_;            // in ticks
+    expired_func on_expired_;
+    boost::mutex cs_;
+    link level0_[l0_size];
+    link level1_[l1_size];
+    // only modified with cs_ locked
+    boost::atomic<size_t> current_;
+    boost::chrono::steady_clock::time_point start_;
+    boost::scoped_ptr<boost::asio::deadline_timer> timer_;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef COMMON_WRITE_QUEUE_HPP
+#define COMMON_WRITE_QUEUE_HPP
+
+#include <string>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+
+/** the outgoing messages of one connection:
+    - push() queues a copy of the message; it can be called while a write
+      is in flight - the message just waits for the next one
+    - start_write() hands out everything queued so far, as one gather
+      (scatter/gather) sequence - write it with async_write, then call
+      end_write()
+    - small messages are appended to the previous one, so lots of short
+      answers don't turn into lots of tiny buffers
+    - messages always go out in the order they were pushed
+    - push() fails once more than max_bytes are waiting: the other party
+      doesn't read what we send, so you'd better drop it
+
+    Usage:
+        if ( !queue.push(msg)) stop();
+        else if ( !queue.writing()) async_write(sock, queue.start_write(), on_write);
+      on_write:
+        queue.end_write();
+        if ( queue.pending()) async_write(sock, queue.start_write(), on_write);
+
+    Not thread safe - lock it, or use it from a single thread (or strand).
+*/
+class write_queue {
+public:
+    typedef std::vector<boost::asio::const_buffer> buffers;
+    // what start_write() returns: refers to our buffers, so that asio
+    // copying it (into the write operation) doesn't allocate
+    class buffers_view {
+    public:
+        typedef boost::asio::const_buffer value_type;
+        typedef buffers::const_iterator const_iterator;
+        explicit buffers_view(const buffers & b) : buffers_(&b) {}
+        const_iterator begin() const { return buffers_->begin(); }
+        const_iterator end() const { return buffers_->end(); }
+    private:
+        const buffers * buffers_;
+    };
+    enum { default_max_bytes = 64 * 1024, coalesce_limit = 1024 };
+
+    explicit write_queue(size_t max_bytes = default_max_bytes)
+        : max_bytes_(max_bytes), bytes_(0), in_flight_bytes_(0) {}
+
+    bool push(const std::string & msg) {
+        if ( bytes_ + msg.size() > max_bytes_) return false;
+        if ( !queued_.empty() && queued_.back().size() + msg.size() <= coalesce_limit)
+            queued_.back() += msg;
+        else
+            queued_.push_back(msg);
+        bytes_ += msg.size();
+        return true;
+    }
+    // something is waiting for start_write()
+    bool pending() const { return !queued_.empty(); }
+    // a write is in flight (between start_write() and end_write())
+    bool writing() const { return !in_flight_.empty(); }
+    // queued + in flight
+    size_t bytes() const { return bytes_; }
+    bool empty() const { return bytes_ == 0; }
+
+    // valid until end_write()
+    buffers_view start_write() {
+        in_flight_.swap(queued_);
+        buffers_.clear();
+        in_flight_bytes_ = 0;
+        for ( size_t i = 0; i < in_flight_.size(); ++i) {
+            buffers_.push_back( boost::asio::buffer(in_flight_[i]));
+            in_flight_bytes_ += in_flight_[i].size();
+        }
+        return buffers_view(buffers_);
+    }
+    // drops everything - only when no write is in flight
+    void clear() {
+        queued_.clear();
+        in_flight_.clear();
+        buffers_.clear();
+        bytes_ = in_flight_bytes_ = 0;
+    }
+    void end_write() {
+        bytes_ -= in_flight_bytes_;
+        in_flight_bytes_ = 0;
+        in_flight_.clear();
+        buffers_.clear();
+    }
+private:
+    size_t max_bytes_;
+    size_t bytes_, in_flight_bytes_;
+    std::vector<std::string> queued_, in_flight_;
+    buffers buffers_;
+};
+
+#endif